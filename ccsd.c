@@ -14,19 +14,42 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <ctype.h>
+#include <math.h>
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <getopt.h>
 
 #ifdef XM_USE_MPI
 #include <mpi.h>
 #endif
 
-#include "xm.h"
+#include "ccsd.h"
 
-static size_t blocksize = 32;
+struct ccsd {
+	xm_allocator_t *allocator;
+	size_t o, v, blocksize, vecwidth, reqwidth;
+	size_t nocc, nvirt, ncore, vfull;
+	double maxtail, fno, *fnovec, *eocc, *evir;
+	int method, planner, grouping, ready, warm;
+	char *equations;
+	struct tensor *tensors;
+	size_t ntensors;
+	struct step *steps;
+	size_t nsteps, nsetup;
+	struct shared *shared;
+	size_t nshared;
+	double flops;
+	xm_block_space_t **bs;
+	xm_tensor_t **t;
+	double energy, emp2;
+	int eqnline;
+	jmp_buf eqnenv;
+};
 
 static void
 print(const char *fmt, ...)
@@ -58,37 +81,139 @@ timer_stop(time_t timer)
 	print("done in %d sec\n", (int)(time(NULL) - timer));
 }
 
+static void *
+xmalloc(size_t size)
+{
+	void *ptr;
+
+	if ((ptr = malloc(size)) == NULL) {
+		perror("malloc");
+		abort();
+	}
+	return ptr;
+}
+
+/*
+ * Allocate a buffer on a 64-byte boundary, the size of a cache line and
+ * of the widest vector registers.
+ */
+static void *
+xmalloc_aligned(size_t size)
+{
+	void *ptr;
+	int rc;
+
+	if ((rc = posix_memalign(&ptr, 64, size)) != 0) {
+		fprintf(stderr, "posix_memalign: %s\n", strerror(rc));
+		abort();
+	}
+	return ptr;
+}
+
+/* Round n up to a whole number of vectors of the given width. */
+static size_t
+pad_width(size_t n, size_t width)
+{
+	return (n + width - 1) / width * width;
+}
+
+/*
+ * Compute the block edges along one spin half of a dimension of length dim.
+ * With width > 1 the edges are whole multiples of width and the remainder
+ * of dim is merged into the last block, so only that block has a partial
+ * vector along its leading dimension.  Returns the number of blocks.
+ */
+static size_t
+block_edges(size_t dim, size_t blocksize, size_t width, size_t *edges)
+{
+	size_t i, nblks, unitsperblk, units, rem;
+
+	if (width == 1) {
+		nblks = dim % blocksize ? dim / blocksize + 1 :
+		    dim / blocksize;
+		for (i = 0; i < nblks - 1; i++) {
+			size_t sz = dim / (nblks - i);
+
+			if (sz > 1 && sz % 2 && nblks - i > 1) {
+				if (sz < blocksize) sz++;
+				else sz--;
+			}
+			dim -= sz;
+			edges[i] = sz;
+		}
+		edges[nblks - 1] = dim;
+		return nblks;
+	}
+	unitsperblk = (blocksize + width - 1) / width;
+	units = dim / width;
+	rem = dim % width;
+	if (units == 0) {
+		edges[0] = dim;
+		return 1;
+	}
+	nblks = (units + unitsperblk - 1) / unitsperblk;
+	for (i = 0; i < nblks; i++)
+		edges[i] = (units / nblks + (i < units % nblks)) * width;
+	edges[nblks - 1] += rem;
+	return nblks;
+}
+
+/*
+ * Fraction of the elements along a dimension of length dim that do not
+ * fill a whole vector of the given width and take the scalar tail path.
+ */
 static double
-random_value(void)
+tail_ratio(size_t dim, size_t width)
+{
+	return (double)(dim % width) / dim;
+}
+
+/*
+ * Reduce the vector width until the scalar tail of both the occupied and
+ * the virtual dimension stays within the maxtail limit.
+ */
+static void
+choose_vecwidth(struct ccsd *cc)
+{
+	double ro, rv;
+
+	while (cc->vecwidth > 1) {
+		ro = tail_ratio(cc->o, cc->vecwidth);
+		rv = tail_ratio(cc->v, cc->vecwidth);
+		if (ro <= cc->maxtail && rv <= cc->maxtail)
+			break;
+		cc->vecwidth /= 2;
+	}
+}
+
+static void
+print_tail(struct ccsd *cc)
 {
-	return drand48() / 1000000.0;
+	print("elements outside whole vectors: o %.1f%%, v %.1f%%\n",
+	    100 * tail_ratio(cc->o, cc->vecwidth),
+	    100 * tail_ratio(cc->v, cc->vecwidth));
 }
 
 static void
-split_block_space(xm_block_space_t *bs)
+split_block_space(struct ccsd *cc, xm_block_space_t *bs)
 {
 	xm_dim_t absdims;
-	size_t i, j, pos;
+	size_t i, j, pos, nblks, *edges;
 
 	absdims = xm_block_space_get_abs_dims(bs);
 
 	for (j = 0; j < absdims.n; j++) {
 		size_t dim = absdims.i[j] / 2;
-		size_t nblks = dim % blocksize ? dim / blocksize + 1 :
-		    dim / blocksize;
-		for(i = 0, pos = 0; i < nblks - 1; i++) {
-			size_t sz = dim / (nblks - i);
 
-			if(sz > 1 && sz % 2 && nblks - i > 1) {
-				if(sz < blocksize) sz++;
-				else sz--;
-			}
-			dim -= sz;
-			pos += sz;
+		edges = xmalloc(dim * sizeof *edges);
+		nblks = block_edges(dim, cc->blocksize, cc->vecwidth, edges);
+		for (i = 0, pos = 0; i < nblks - 1; i++) {
+			pos += edges[i];
 			xm_block_space_split(bs, j, pos);
 			xm_block_space_split(bs, j, absdims.i[j] / 2 + pos);
 		}
 		xm_block_space_split(bs, j, absdims.i[j] / 2);
+		free(edges);
 	}
 }
 
@@ -527,348 +652,3234 @@ init_oovv(size_t o, size_t v, xm_tensor_t *oovv)
 	}}}
 }
 
+/*
+ * The second index has w blocks per spin and the last two have v, so the
+ * same setup serves tensors whose second index spans another space.
+ */
 static void
-init_ovvv(size_t o, size_t v, xm_tensor_t *ovvv)
+init_ovvv(size_t o, size_t w, size_t v, xm_tensor_t *ovvv)
 {
 	size_t i, a, b, c;
 
 	for (i = 0; i < o; i++) {
-	for (a = 0; a < v; a++) {
+	for (a = 0; a < w; a++) {
 	for (b = 0; b < v; b++) {
 	for (c = b; c < v; c++) {
 		/* aaaa */
 		xm_tensor_set_canonical_block(ovvv, xm_dim_4(i,a,b,c));
 		/* bbbb */
-		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a+v,b+v,c+v),
+		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a+w,b+v,c+v),
 		    xm_dim_4(i,a,b,c), xm_dim_4(0,1,2,3), 1);
 		/* abab */
-		xm_tensor_set_canonical_block(ovvv, xm_dim_4(i,a+v,b,c+v));
+		xm_tensor_set_canonical_block(ovvv, xm_dim_4(i,a+w,b,c+v));
 		/* baba */
 		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a,b+v,c),
-		    xm_dim_4(i,a+v,b,c+v), xm_dim_4(0,1,2,3), 1);
+		    xm_dim_4(i,a+w,b,c+v), xm_dim_4(0,1,2,3), 1);
 		/* abba */
-		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i,a+v,b+v,c),
-		    xm_dim_4(i,a+v,b,c+v), xm_dim_4(0,1,2,3), 1);
+		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i,a+w,b+v,c),
+		    xm_dim_4(i,a+w,b,c+v), xm_dim_4(0,1,2,3), 1);
 		/* baab */
 		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a,b,c+v),
-		    xm_dim_4(i,a+v,b,c+v), xm_dim_4(0,1,2,3), 1);
+		    xm_dim_4(i,a+w,b,c+v), xm_dim_4(0,1,2,3), 1);
 	}}}}
 	for (i = 0; i < o; i++) {
-	for (a = 0; a < v; a++) {
+	for (a = 0; a < w; a++) {
 	for (b = 0; b < v; b++) {
 	for (c = 0; c < b; c++) {
 		/* aaaa */
 		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i,a,b,c),
 		    xm_dim_4(i,a,c,b), xm_dim_4(0,1,3,2), -1);
 		/* bbbb */
-		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a+v,b+v,c+v),
+		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a+w,b+v,c+v),
 		    xm_dim_4(i,a,c,b), xm_dim_4(0,1,3,2), -1);
 		/* abab */
-		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i,a+v,b,c+v),
-		    xm_dim_4(i,a+v,c,b+v), xm_dim_4(0,1,3,2), -1);
+		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i,a+w,b,c+v),
+		    xm_dim_4(i,a+w,c,b+v), xm_dim_4(0,1,3,2), -1);
 		/* baba */
 		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a,b+v,c),
-		    xm_dim_4(i,a+v,c,b+v), xm_dim_4(0,1,3,2), -1);
+		    xm_dim_4(i,a+w,c,b+v), xm_dim_4(0,1,3,2), -1);
 		/* abba */
-		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i,a+v,b+v,c),
-		    xm_dim_4(i,a+v,c,b+v), xm_dim_4(0,1,3,2), -1);
+		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i,a+w,b+v,c),
+		    xm_dim_4(i,a+w,c,b+v), xm_dim_4(0,1,3,2), -1);
 		/* baab */
 		xm_tensor_set_derivative_block(ovvv, xm_dim_4(i+o,a,b,c+v),
-		    xm_dim_4(i,a+v,c,b+v), xm_dim_4(0,1,3,2), -1);
+		    xm_dim_4(i,a+w,c,b+v), xm_dim_4(0,1,3,2), -1);
 	}}}}
 }
 
+void dgemm_(const char *, const char *, const int *, const int *,
+    const int *, const double *, const double *, const int *,
+    const double *, const int *, const double *, double *, const int *);
+void dsyev_(const char *, const char *, const int *, double *, const int *,
+    double *, double *, const int *, int *);
+
+/*
+ * Gather a 2-index block-tensor into a dense column-major matrix with
+ * leading dimension ld.  Blocks are stored by libxm with the first index
+ * varying fastest.
+ */
 static void
-usage(void)
+gather_matrix(const xm_tensor_t *t, double *mat, size_t ld)
 {
-	print("usage: ccsd [-b bs] [-o no] [-v nv]\n");
-#ifdef XM_USE_MPI
-	MPI_Finalize();
-#endif
-	exit(1);
+	xm_dim_t nblks, blkdims, idx;
+	size_t i, j, ii, jj, row, col;
+	double *blk;
+
+	nblks = xm_tensor_get_nblocks(t);
+	blk = xmalloc(xm_tensor_get_largest_block_size(t) * sizeof *blk);
+	for (j = 0, col = 0; j < nblks.i[1]; j++) {
+	for (i = 0, row = 0; i < nblks.i[0]; i++) {
+		idx = xm_dim_2(i, j);
+		blkdims = xm_tensor_get_block_dims(t, idx);
+		if (xm_tensor_get_block_type(t, idx) == XM_BLOCK_TYPE_ZERO) {
+			for (jj = 0; jj < blkdims.i[1]; jj++)
+			for (ii = 0; ii < blkdims.i[0]; ii++)
+				mat[(col+jj)*ld+row+ii] = 0;
+		} else {
+			xm_tensor_read_block(t, idx, blk);
+			for (jj = 0; jj < blkdims.i[1]; jj++)
+			for (ii = 0; ii < blkdims.i[0]; ii++)
+				mat[(col+jj)*ld+row+ii] =
+				    blk[jj*blkdims.i[0]+ii];
+		}
+		row += blkdims.i[0];
+		if (i == nblks.i[0] - 1)
+			col += blkdims.i[1];
+	}}
+	free(blk);
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Write a dense column-major matrix with leading dimension ld back to the
+ * canonical blocks of a 2-index block-tensor.
+ */
+static void
+scatter_matrix(xm_tensor_t *t, const double *mat, size_t ld)
 {
-	xm_allocator_t *allocator;
-	xm_block_space_t *bsoo, *bsov, *bsvv;
-	xm_block_space_t *bsoooo, *bsooov, *bsovov, *bsoovv, *bsovvv, *bsvvvv;
-	xm_tensor_t *f_oo, *f_ov, *f_vv, *f1_vv, *f2_oo, *f2_ov, *f2_vv;
-	xm_tensor_t *f3_oo, *d_ov, *t1, *t1new;
-	xm_tensor_t *i_oooo, *i4_oooo, *i_ooov, *i2a_ooov, *i_ovov, *i1a_ovov;
-	xm_tensor_t *i_oovv, *tt_oovv, *i_ovvv, *i_vvvv, *d_oovv, *t2, *t2new;
-	xm_dim_t nblks;
-	double energy;
-	size_t ob, vb, o = 10, v = 40;
-	int ch, type = XM_SCALAR_DOUBLE;
-	time_t timer;
+	xm_dim_t nblks, blkdims, idx;
+	size_t i, j, ii, jj, row, col;
+	double *blk;
+	int rank = 0;
 
 #ifdef XM_USE_MPI
-	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 #endif
-	while ((ch = getopt(argc, argv, "b:o:v:")) != -1) {
-		switch (ch) {
-		case 'b':
-			blocksize = (size_t)strtoll(optarg, NULL, 10);
-			break;
-		case 'o':
-			o = (size_t)strtoll(optarg, NULL, 10);
-			break;
-		case 'v':
-			v = (size_t)strtoll(optarg, NULL, 10);
-			break;
-		default:
-			usage();
+	nblks = xm_tensor_get_nblocks(t);
+	blk = xmalloc(xm_tensor_get_largest_block_size(t) * sizeof *blk);
+	for (j = 0, col = 0; j < nblks.i[1]; j++) {
+	for (i = 0, row = 0; i < nblks.i[0]; i++) {
+		idx = xm_dim_2(i, j);
+		blkdims = xm_tensor_get_block_dims(t, idx);
+		if (rank == 0 && xm_tensor_get_block_type(t, idx) ==
+		    XM_BLOCK_TYPE_CANONICAL) {
+			for (jj = 0; jj < blkdims.i[1]; jj++)
+			for (ii = 0; ii < blkdims.i[0]; ii++)
+				blk[jj*blkdims.i[0]+ii] =
+				    mat[(col+jj)*ld+row+ii];
+			xm_tensor_write_block(t, idx, blk);
 		}
+		row += blkdims.i[0];
+		if (i == nblks.i[0] - 1)
+			col += blkdims.i[1];
+	}}
+	free(blk);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+/*
+ * Contraction of two matrices over one index.  For 2-index tensors libxm
+ * issues one small GEMM per block triple, so instead the operands are
+ * gathered into dense matrices and the whole product is done by a single
+ * GEMM call.  The columns of the matrices are aligned and padded to the
+ * vector width.
+ */
+static void
+contract_2d(xm_scalar_t alpha, const xm_tensor_t *a, const xm_tensor_t *b,
+    xm_scalar_t beta, xm_tensor_t *c, const char *idxa, const char *idxb,
+    const char *idxc, size_t width)
+{
+	xm_dim_t dimsa, dimsb, dimsc;
+	double *ma, *mb, *mc, al = alpha, be = beta;
+	char k, n, ta, tb;
+	int lda, ldb, ldc, mm, nn, kk;
+
+	dimsa = xm_tensor_get_abs_dims(a);
+	dimsb = xm_tensor_get_abs_dims(b);
+	dimsc = xm_tensor_get_abs_dims(c);
+	lda = (int)pad_width(dimsa.i[0], width);
+	ldb = (int)pad_width(dimsb.i[0], width);
+	ldc = (int)pad_width(dimsc.i[0], width);
+	ma = xmalloc_aligned((size_t)lda * dimsa.i[1] * sizeof *ma);
+	mb = xmalloc_aligned((size_t)ldb * dimsb.i[1] * sizeof *mb);
+	mc = xmalloc_aligned((size_t)ldc * dimsc.i[1] * sizeof *mc);
+	gather_matrix(a, ma, (size_t)lda);
+	gather_matrix(b, mb, (size_t)ldb);
+	if (be != 0)
+		gather_matrix(c, mc, (size_t)ldc);
+	k = idxa[0] == idxb[0] || idxa[0] == idxb[1] ? idxa[0] : idxa[1];
+	n = idxb[0] == k ? idxb[1] : idxb[0];
+	kk = (int)(idxa[0] == k ? dimsa.i[0] : dimsa.i[1]);
+	if (idxc[1] == n) {
+		/* c(m,n) = a(m,k) b(k,n) */
+		mm = (int)dimsc.i[0];
+		nn = (int)dimsc.i[1];
+		ta = idxa[0] == k ? 'T' : 'N';
+		tb = idxb[0] == k ? 'N' : 'T';
+		dgemm_(&ta, &tb, &mm, &nn, &kk, &al, ma, &lda, mb, &ldb,
+		    &be, mc, &ldc);
+	} else {
+		/* c(n,m) = b(n,k) a(k,m) */
+		nn = (int)dimsc.i[0];
+		mm = (int)dimsc.i[1];
+		tb = idxb[0] == k ? 'T' : 'N';
+		ta = idxa[0] == k ? 'N' : 'T';
+		dgemm_(&tb, &ta, &nn, &mm, &kk, &al, mb, &ldb, ma, &lda,
+		    &be, mc, &ldc);
 	}
-	argc -= optind;
-	argv += optind;
+	scatter_matrix(c, mc, (size_t)ldc);
+	free(ma);
+	free(mb);
+	free(mc);
+}
 
-	if (blocksize == 0 || o == 0 || v == 0)
-		usage();
-	print("CCSD, C1, o %zu, v %zu, blocksize %zu\n", o, v, blocksize);
+static int
+is_matrix_product(const char *idxa, const char *idxb, const char *idxc)
+{
+	int i, j, nk = 0;
 
-	timer = timer_start("creating the objects");
-	allocator = xm_allocator_create("xmpagefile");
-
-	bsoo = xm_block_space_create(xm_dim_2(2*o, 2*o));
-	bsov = xm_block_space_create(xm_dim_2(2*o, 2*v));
-	bsvv = xm_block_space_create(xm_dim_2(2*v, 2*v));
-	bsoooo = xm_block_space_create(xm_dim_4(2*o, 2*o, 2*o, 2*o));
-	bsooov = xm_block_space_create(xm_dim_4(2*o, 2*o, 2*o, 2*v));
-	bsovov = xm_block_space_create(xm_dim_4(2*o, 2*v, 2*o, 2*v));
-	bsoovv = xm_block_space_create(xm_dim_4(2*o, 2*o, 2*v, 2*v));
-	bsovvv = xm_block_space_create(xm_dim_4(2*o, 2*v, 2*v, 2*v));
-	bsvvvv = xm_block_space_create(xm_dim_4(2*v, 2*v, 2*v, 2*v));
-
-	split_block_space(bsoo);
-	split_block_space(bsov);
-	split_block_space(bsvv);
-	split_block_space(bsoooo);
-	split_block_space(bsooov);
-	split_block_space(bsovov);
-	split_block_space(bsoovv);
-	split_block_space(bsovvv);
-	split_block_space(bsvvvv);
-
-	nblks = xm_block_space_get_nblocks(bsov);
-	ob = nblks.i[0] / 2;
-	vb = nblks.i[1] / 2;
-
-	f_oo = xm_tensor_create(bsoo, type, allocator);
-	f_ov = xm_tensor_create(bsov, type, allocator);
-	f_vv = xm_tensor_create(bsvv, type, allocator);
-	f1_vv = xm_tensor_create(bsvv, type, allocator);
-	f2_oo = xm_tensor_create(bsoo, type, allocator);
-	f2_ov = xm_tensor_create(bsov, type, allocator);
-	f2_vv = xm_tensor_create(bsvv, type, allocator);
-	f3_oo = xm_tensor_create(bsoo, type, allocator);
-	d_ov = xm_tensor_create(bsov, type, allocator);
-	t1 = xm_tensor_create(bsov, type, allocator);
-	t1new = xm_tensor_create(bsov, type, allocator);
-	i_oooo = xm_tensor_create(bsoooo, type, allocator);
-	i4_oooo = xm_tensor_create(bsoooo, type, allocator);
-	i_ooov = xm_tensor_create(bsooov, type, allocator);
-	i2a_ooov = xm_tensor_create(bsooov, type, allocator);
-	i_ovov = xm_tensor_create(bsovov, type, allocator);
-	i1a_ovov = xm_tensor_create(bsovov, type, allocator);
-	i_oovv = xm_tensor_create(bsoovv, type, allocator);
-	tt_oovv = xm_tensor_create(bsoovv, type, allocator);
-	i_ovvv = xm_tensor_create(bsovvv, type, allocator);
-	i_vvvv = xm_tensor_create(bsvvvv, type, allocator);
-	d_oovv = xm_tensor_create(bsoovv, type, allocator);
-	t2 = xm_tensor_create(bsoovv, type, allocator);
-	t2new = xm_tensor_create(bsoovv, type, allocator);
-
-	init_oo(ob, vb, f_oo);
-	init_ov(ob, vb, f_ov);
-	init_oo(vb, ob, f_vv);
-	init_oo(vb, ob, f1_vv);
-	init_oo(ob, vb, f2_oo);
-	init_ov(ob, vb, f2_ov);
-	init_oo(vb, ob, f2_vv);
-	init_oo(ob, vb, f3_oo);
-	init_ov(ob, vb, d_ov);
-	init_ov(ob, vb, t1);
-	init_ov(ob, vb, t1new);
-	init_oooo(ob, vb, i_oooo);
-	init_oooo(ob, vb, i4_oooo);
-	init_ooov(ob, vb, i_ooov);
-	init_ooov(ob, vb, i2a_ooov);
-	init_ovov(ob, vb, i_ovov);
-	init_ovov(ob, vb, i1a_ovov);
-	init_oovv(ob, vb, i_oovv);
-	init_oovv(ob, vb, tt_oovv);
-	init_ovvv(ob, vb, i_ovvv);
-	init_oooo(vb, ob, i_vvvv);
-	init_oovv(ob, vb, d_oovv);
-	init_oovv(ob, vb, t2);
-	init_oovv(ob, vb, t2new);
-	timer_stop(timer);
+	if (strlen(idxa) != 2 || strlen(idxb) != 2 || strlen(idxc) != 2)
+		return 0;
+	for (i = 0; i < 2; i++)
+	for (j = 0; j < 2; j++)
+		if (idxa[i] == idxb[j])
+			nk++;
+	if (nk != 1 || idxc[0] == idxc[1])
+		return 0;
+	/* c must hold exactly the two free letters */
+	for (i = 0; i < 2; i++)
+		if ((strchr(idxa, idxc[i]) != NULL) ==
+		    (strchr(idxb, idxc[i]) != NULL))
+			return 0;
+	return 1;
+}
 
-	timer = timer_start("filling the tensors");
-	xm_set(f_oo, random_value());
-	xm_set(f_ov, random_value());
-	xm_set(f_vv, random_value());
-	xm_set(f1_vv, random_value());
-	xm_set(f2_oo, random_value());
-	xm_set(f2_ov, random_value());
-	xm_set(f2_vv, random_value());
-	xm_set(f3_oo, random_value());
-	xm_set(d_ov, random_value());
-	xm_set(t1, random_value());
-	xm_set(t1new, random_value());
-	xm_set(i_oooo, random_value());
-	xm_set(i4_oooo, random_value());
-	xm_set(i_ooov, random_value());
-	xm_set(i2a_ooov, random_value());
-	xm_set(i_ovov, random_value());
-	xm_set(i1a_ovov, random_value());
-	xm_set(i_oovv, random_value());
-	xm_set(tt_oovv, random_value());
-	xm_set(i_ovvv, random_value());
-	xm_set(i_vvvv, random_value());
-	xm_set(d_oovv, random_value());
-	xm_set(t2, random_value());
-	xm_set(t2new, random_value());
-	timer_stop(timer);
+/*
+ * Check for a product of a tensor a with a 2-index tensor b where every
+ * letter of c comes from exactly one operand and every other letter is
+ * summed over, e.g. i_ooov(ikjb) t1(ka) -> (iajb) or t1(ia) t1(jb).
+ */
+static int
+is_t1_product(const char *idxa, const char *idxb, const char *idxc)
+{
+	size_t i, ns = 0;
+	int ina, inb;
 
-	timer = timer_start("running one ccsd iteration");
-	print("\nf1_vv\n");
-	xm_copy(f1_vv, 1, f_vv, "ab", "ab");
-	xm_contract(-0.5, i_oovv, t2, 1, f1_vv, "abcd", "abed", "ec");
-	xm_contract(1, i_ovvv, t1, 1, f1_vv, "abcd", "ac", "bd");
-	print("f2_ov\n");
-	xm_copy(f2_ov, 1, f_ov, "ia", "ia");
-	xm_contract(1, t1, i_oovv, 1, f2_ov, "ab", "cadb", "cd");
-	print("f3_oo\n");
-	xm_copy(f3_oo, 1, f_oo, "ij", "ij");
-	xm_contract(1, f2_ov, t1, 1, f3_oo, "ab", "cb", "ac");
-	xm_contract(0.5, i_oovv, t2, 1, f3_oo, "abcd", "ebcd", "ae");
-	xm_contract(1, i_ooov, t1, 1, f3_oo, "abcd", "bd", "ac");
-	print("t1\n");
-	xm_copy(t1new, 1, f_ov, "ia", "ia");
-	xm_contract(1, f1_vv, t1, 1, t1new, "ab", "cb", "ca");
-	xm_contract(-1, f3_oo, t1, 1, t1new, "ab", "ac", "bc");
-	xm_contract(-1, i_ovov, t1, 1, t1new, "abcd", "cb", "ad");
-	xm_contract(1, t2, f2_ov, 1, t1new, "abcd", "bd", "ac");
-	xm_contract(0.5, i_ovvv, t2, 1, t1new, "abcd", "aecd", "eb");
-	xm_contract(-0.5, i_ooov, t2, 1, t1new, "abcd", "abed", "ce");
-	xm_div(t1new, d_ov, "ia", "ia");
-	print("f2_oo\n");
-	xm_contract(1, t1, t1, 0, i1a_ovov, "ab", "cd", "abcd");
-	xm_copy(f2_oo, 1, f_oo, "ij", "ij");
-	xm_contract(1, f_ov, t1, 1, f2_oo, "ab", "cb", "ca");
-	xm_contract(1, i_ooov, t1, 1, f2_oo, "abcd", "bd", "ca");
-	xm_contract(1, i_oovv, i1a_ovov, 1, f2_oo, "abcd", "ecbd", "ea");
-	xm_contract(0.5, i_oovv, t2, 1, f2_oo, "abcd", "ebcd", "ea");
-	print("f2_vv\n");
-	xm_copy(f2_vv, 1, f1_vv, "ab", "ab");
-	xm_contract(-1, f_ov, t1, 1, f2_vv, "ab", "ac", "cb");
-	/* from above i1a_ovov = t1 * t1 */
-	xm_contract(-1, i_oovv, i1a_ovov, 1, f2_vv, "abcd", "aebd", "ec");
-	print("i1a_ovov\n");
-	xm_copy(t2new, 1, t2, "ijab", "ijab");
-	xm_contract(2, t1, t1, 1, t2new, "ab", "cd", "acbd");
-	xm_copy(i1a_ovov, 1, i_ovov, "iajb", "iajb");
-	xm_contract(-1, i_ovvv, t1, 1, i1a_ovov, "abcd", "ed", "abec");
-	xm_contract(-1, i_ooov, t1, 1, i1a_ovov, "abcd", "be", "aecd");
-	xm_contract(-0.5, t2new, i_oovv, 1, i1a_ovov, "abcd", "ebcf", "edaf");
-	print("tt_oovv\n");
-	xm_copy(tt_oovv, 1, t2, "ijab", "ijab");
-	xm_contract(0.5, t1, t1, 1, tt_oovv, "ab", "cd", "acbd");
-	print("i4_oooo\n");
-	xm_copy(i4_oooo, 1, i_oooo, "abcd", "abcd");
-	xm_contract(0.5, i_oovv, tt_oovv, 1, i4_oooo, "abcd", "efcd", "efab");
-	xm_contract(1, i_ooov, t1, 1, i4_oooo, "abcd", "ed", "ceab");
-	print("i2a_ooov\n");
-	xm_copy(i2a_ooov, 1, i_ooov, "abcd", "abcd");
-	xm_contract(-0.5, i4_oooo, t1, 1, i2a_ooov, "abcd", "de", "abce");
-	xm_contract(0.5, tt_oovv, i_ovvv, 1, i2a_ooov, "abcd", "efcd", "abef");
-	xm_contract(1, i_ovov, t1, 1, i2a_ooov, "abcd", "ed", "ceab");
-	print("t2\n");
-	xm_copy(t2new, 1, i_oovv, "ijab", "ijab");
-	xm_contract(1, t2, f2_vv, 1, t2new, "abcd", "ed", "abce");
-	xm_contract(-1, i2a_ooov, t1, 1, t2new, "abcd", "ce", "abed");
-	xm_contract(1, i1a_ovov, t2, 1, t2new, "abcd", "eafd", "cefb");
-	xm_contract(1, i_ovvv, t1, 1, t2new, "abcd", "eb", "eadc");
-	xm_contract(-1, t2, f2_oo, 1, t2new, "abcd", "eb", "aecd");
-	xm_contract(0.5, i_vvvv, tt_oovv, 1, t2new, "abcd", "efcd", "efab");
-	xm_contract(0.5, t2, i4_oooo, 1, t2new, "abcd", "efab", "efcd");
-	xm_div(t2new, d_oovv, "ijab", "ijab");
-	print("energy ");
-	xm_copy(t1, 1, t1new, "ia", "ia");
-	xm_copy(t2, 1, t2new, "ijab", "ijab");
-	xm_contract(1, i_oovv, t1, 0, t1new, "abcd", "bd", "ac");
-	energy = xm_dot(f_ov, t1, "ia", "ia") +
-		 0.5 * xm_dot(t1new, t1, "ia", "ia") +
-		 0.25 * xm_dot(i_oovv, t2, "ijab", "ijab");
-	print("= %.10lf\n", energy);
-	timer_stop(timer);
+	if (strlen(idxb) != 2 || strlen(idxa) < 2 || idxb[0] == idxb[1])
+		return 0;
+	for (i = 0; idxc[i]; i++) {
+		ina = strchr(idxa, idxc[i]) != NULL;
+		inb = strchr(idxb, idxc[i]) != NULL;
+		if (ina == inb || strchr(idxc + i + 1, idxc[i]) != NULL)
+			return 0;
+		ns += ina;
+	}
+	for (i = 0; idxa[i]; i++)
+		if (strchr(idxc, idxa[i]) == NULL &&
+		    strchr(idxb, idxa[i]) == NULL)
+			return 0;
+	for (i = 0; idxb[i]; i++)
+		if (strchr(idxc, idxb[i]) == NULL &&
+		    strchr(idxa, idxb[i]) == NULL)
+			return 0;
+	return ns > 0;
+}
+
+/* Compute the offsets of the blocks along dimension dim of tensor t. */
+static void
+block_offsets(const xm_tensor_t *t, size_t dim, size_t *off)
+{
+	xm_dim_t nblks, idx, blkdims;
+	size_t i;
+
+	nblks = xm_tensor_get_nblocks(t);
+	idx = nblks;
+	for (i = 0; i < idx.n; i++)
+		idx.i[i] = 0;
+	off[0] = 0;
+	for (i = 0; i < nblks.i[dim]; i++) {
+		idx.i[dim] = i;
+		blkdims = xm_tensor_get_block_dims(t, idx);
+		off[i+1] = off[i] + blkdims.i[dim];
+	}
+}
+
+/*
+ * Copy the n-dimensional block src into dst so that dimension k of dst is
+ * dimension perm[k] of src.  Both are stored first index fastest, dst as
+ * a matrix with columns of rows elements that start ld elements apart.
+ */
+static void
+permute_rows(const double *src, const size_t *dims, size_t n,
+    const size_t *perm, double *dst, size_t rows, size_t ld)
+{
+	size_t i, k, len = 1, off = 0, pos = 0, row = 0;
+	size_t sstride[XM_MAX_DIM], stride[XM_MAX_DIM], ddims[XM_MAX_DIM];
+	size_t idx[XM_MAX_DIM];
+
+	for (k = 0; k < n; k++) {
+		sstride[k] = len;
+		len *= dims[k];
+	}
+	for (k = 0; k < n; k++) {
+		ddims[k] = dims[perm[k]];
+		stride[k] = sstride[perm[k]];
+		idx[k] = 0;
+	}
+	for (i = 0; i < len; i++) {
+		dst[pos++] = src[off];
+		if (++row == rows) {
+			pos += ld - rows;
+			row = 0;
+		}
+		for (k = 0; k < n; k++) {
+			off += stride[k];
+			if (++idx[k] < ddims[k])
+				break;
+			off -= stride[k] * ddims[k];
+			idx[k] = 0;
+		}
+	}
+}
+
+static void
+permute_block(const double *src, const size_t *dims, size_t n,
+    const size_t *perm, double *dst)
+{
+	permute_rows(src, dims, n, perm, dst, 1, 1);
+}
+
+static size_t
+letter_pos(const char *idx, char l)
+{
+	return (size_t)(strchr(idx, l) - idx);
+}
+
+/*
+ * Copy the box of dimensions d at offsets off of the dense array a with
+ * dimensions ad into the dense block b.  If put is 1 copy from b into a
+ * instead, if put is 2 add b to a.
+ */
+static void
+copy_box(double *a, const size_t *ad, const size_t *off, double *b,
+    const size_t *d, size_t n, int put)
+{
+	size_t i, j, k, len, pos, idx[XM_MAX_DIM], stride[XM_MAX_DIM];
+
+	for (k = 0, len = 1; k < n; k++) {
+		stride[k] = len;
+		len *= ad[k];
+		idx[k] = 0;
+	}
+	for (k = 0, len = 1; k < n; k++)
+		len *= d[k];
+	for (i = 0; i < len; i += d[0]) {
+		for (k = 0, pos = 0; k < n; k++)
+			pos += (off[k] + idx[k]) * stride[k];
+		if (put == 2)
+			for (j = 0; j < d[0]; j++)
+				a[pos+j] += b[i+j];
+		else if (put)
+			memcpy(a + pos, b + i, d[0] * sizeof *b);
+		else
+			memcpy(b + i, a + pos, d[0] * sizeof *b);
+		for (k = 1; k < n; k++) {
+			if (++idx[k] < d[k])
+				break;
+			idx[k] = 0;
+		}
+	}
+}
+
+struct keyed {
+	size_t key, i;
+};
+
+static int
+compare_keyed(const void *a, const void *b)
+{
+	const struct keyed *x = a, *y = b;
+
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/*
+ * Layout of a contraction of a tensor a with a 2-index tensor b into c.
+ * The letters of c are split into the spectators sl from a and the free
+ * letters xl from b; kl are the letters of b summed with a.  The blocks
+ * of a are permuted to spectators then summed letters by perma, and the
+ * results, spectators then free letters, back to c by permr.  The dense
+ * matrices have their columns padded to width elements.
+ */
+struct t1prod {
+	char sl[XM_MAX_DIM+1], kl[3], xl[3];
+	size_t na, nc, ns, nk, nx, xn, maxk, maxm, width, ldb;
+	size_t perma[XM_MAX_DIM], permr[XM_MAX_DIM], bdim[2], xdim[2];
+	size_t *offa[XM_MAX_DIM], *offc[XM_MAX_DIM];
+	xm_dim_t dimsb, nblksa, nblksc;
+	double *mb;
+};
+
+/* Largest extent of the nblks blocks with offsets off. */
+static size_t
+max_extent(const size_t *off, size_t nblks)
+{
+	size_t i, m = 0;
+
+	for (i = 0; i < nblks; i++)
+		if (off[i+1] - off[i] > m)
+			m = off[i+1] - off[i];
+	return m;
+}
+
+static void
+t1prod_init(struct t1prod *p, const xm_tensor_t *a, const xm_tensor_t *b,
+    const xm_tensor_t *c, const char *idxa, const char *idxb,
+    const char *idxc, size_t width)
+{
+	char sx[XM_MAX_DIM+1];
+	size_t i, d;
+
+	p->na = strlen(idxa);
+	p->nc = strlen(idxc);
+	p->ns = p->nk = p->nx = 0;
+	for (i = 0; i < p->nc; i++) {
+		if (strchr(idxa, idxc[i]) != NULL)
+			p->sl[p->ns++] = idxc[i];
+		else
+			p->xl[p->nx++] = idxc[i];
+	}
+	for (i = 0; i < 2; i++)
+		if (strchr(idxa, idxb[i]) != NULL)
+			p->kl[p->nk++] = idxb[i];
+	p->sl[p->ns] = p->kl[p->nk] = p->xl[p->nx] = '\0';
+	strcpy(sx, p->sl);
+	strcat(sx, p->xl);
+	for (i = 0; i < p->ns; i++)
+		p->perma[i] = letter_pos(idxa, p->sl[i]);
+	for (i = 0; i < p->nk; i++)
+		p->perma[p->ns+i] = letter_pos(idxa, p->kl[i]);
+	for (i = 0; i < p->nc; i++)
+		p->permr[i] = letter_pos(sx, idxc[i]);
+	/* dimension of b holding each summed and then each free letter */
+	for (i = 0; i < p->nk; i++)
+		p->bdim[i] = letter_pos(idxb, p->kl[i]);
+	for (i = 0; i < p->nx; i++)
+		p->bdim[p->nk+i] = letter_pos(idxb, p->xl[i]);
+
+	p->nblksa = xm_tensor_get_nblocks(a);
+	p->nblksc = xm_tensor_get_nblocks(c);
+	for (i = 0; i < p->na; i++) {
+		p->offa[i] = xmalloc((p->nblksa.i[i] + 1) * sizeof **p->offa);
+		block_offsets(a, i, p->offa[i]);
+	}
+	for (i = 0; i < p->nc; i++) {
+		p->offc[i] = xmalloc((p->nblksc.i[i] + 1) * sizeof **p->offc);
+		block_offsets(c, i, p->offc[i]);
+	}
+	p->maxk = p->maxm = 1;
+	for (i = 0; i < p->nk; i++) {
+		d = p->perma[p->ns+i];
+		p->maxk *= max_extent(p->offa[d], p->nblksa.i[d]);
+	}
+	for (i = 0; i < p->ns; i++) {
+		d = p->perma[i];
+		p->maxm *= max_extent(p->offa[d], p->nblksa.i[d]);
+	}
+	p->dimsb = xm_tensor_get_abs_dims(b);
+	for (i = 0, p->xn = 1; i < p->nx; i++) {
+		p->xdim[i] = p->dimsb.i[p->bdim[p->nk+i]];
+		p->xn *= p->xdim[i];
+	}
+	p->width = width;
+	p->ldb = pad_width(p->dimsb.i[0], width);
+	p->mb = xmalloc_aligned(p->ldb * p->dimsb.i[1] * sizeof *p->mb);
+	gather_matrix(b, p->mb, p->ldb);
+}
+
+static void
+t1prod_free(struct t1prod *p)
+{
+	size_t i;
+
+	free(p->mb);
+	for (i = 0; i < p->na; i++)
+		free(p->offa[i]);
+	for (i = 0; i < p->nc; i++)
+		free(p->offc[i]);
+}
+
+/*
+ * Multiply block aidx of a with dimensions adim, read into ablk, by the
+ * rows of b it needs over all values of the free letters and store the
+ * result in r scaled by beta, which is then m by xn where m is the size
+ * of the block over the spectators.  The columns of am, bm and r are
+ * padded to the vector width, so am needs room for maxk columns and bm
+ * and r for xn.  Returns the leading dimension of r.
+ */
+static size_t
+t1prod_block(const struct t1prod *p, xm_dim_t aidx, const size_t *adim,
+    const double *ablk, double *am, double *bm, double *r, double beta)
+{
+	size_t j, k, q, m, kk, lda, ldk, len;
+	double one = 1;
+	int mm, nn, ik, ia, ib;
+
+	for (j = 0, m = 1; j < p->ns; j++)
+		m *= adim[p->perma[j]];
+	for (j = 0, kk = 1; j < p->nk; j++)
+		kk *= adim[p->perma[p->ns+j]];
+	lda = pad_width(m, p->width);
+	ldk = pad_width(kk, p->width);
+	permute_rows(ablk, adim, p->na, p->perma, am, m, lda);
+	/* the rows of b, summed letters first */
+	for (q = 0; q < kk * p->xn; q++) {
+		size_t kq = q % kk, xq = q / kk, rc[2];
+
+		for (j = 0; j < p->nk; j++) {
+			k = p->perma[p->ns+j];
+			len = adim[k];
+			rc[p->bdim[j]] = kq % len + p->offa[k][aidx.i[k]];
+			kq /= len;
+		}
+		for (j = 0; j < p->nx; j++) {
+			rc[p->bdim[p->nk+j]] = xq % p->xdim[j];
+			xq /= p->xdim[j];
+		}
+		bm[q/kk*ldk+q%kk] = p->mb[rc[1]*p->ldb+rc[0]];
+	}
+	mm = (int)m;
+	nn = (int)p->xn;
+	ik = (int)kk;
+	ia = (int)lda;
+	ib = (int)ldk;
+	dgemm_("N", "N", &mm, &nn, &ik, &one, am, &ia, bm, &ib, &beta, r,
+	    &ia);
+	return lda;
+}
+
+/*
+ * Contraction with a 2-index tensor b, which is gathered into a dense
+ * matrix once.  The canonical blocks of c are grouped by their spectator
+ * indices.  For each group every block of a is read once and multiplied,
+ * with its spectator indices folded into the rows and the summed indices
+ * into the columns, by one GEMM against the rows of b over all values of
+ * the free indices.  The blocks of c are then cut out of the result.
+ */
+static void
+contract_t1(xm_scalar_t alpha, const xm_tensor_t *a, const xm_tensor_t *b,
+    xm_scalar_t beta, xm_tensor_t *c, const char *idxa, const char *idxb,
+    const char *idxc, size_t width)
+{
+	struct t1prod p;
+	xm_dim_t *blks;
+	struct keyed *keys;
+	double al = alpha, be = beta;
+	size_t *grp, g, i, j, k, ng, nblks, maxa, maxc;
+	int rank = 0, nproc = 1;
 
-	timer = timer_start("releasing the resources");
-	xm_tensor_free_block_data(f_oo);
-	xm_tensor_free_block_data(f_ov);
-	xm_tensor_free_block_data(f_vv);
-	xm_tensor_free_block_data(f1_vv);
-	xm_tensor_free_block_data(f2_oo);
-	xm_tensor_free_block_data(f2_ov);
-	xm_tensor_free_block_data(f2_vv);
-	xm_tensor_free_block_data(f3_oo);
-	xm_tensor_free_block_data(d_ov);
-	xm_tensor_free_block_data(t1);
-	xm_tensor_free_block_data(t1new);
-	xm_tensor_free_block_data(i_oooo);
-	xm_tensor_free_block_data(i4_oooo);
-	xm_tensor_free_block_data(i_ooov);
-	xm_tensor_free_block_data(i2a_ooov);
-	xm_tensor_free_block_data(i_ovov);
-	xm_tensor_free_block_data(i1a_ovov);
-	xm_tensor_free_block_data(i_oovv);
-	xm_tensor_free_block_data(tt_oovv);
-	xm_tensor_free_block_data(i_ovvv);
-	xm_tensor_free_block_data(i_vvvv);
-	xm_tensor_free_block_data(d_oovv);
-	xm_tensor_free_block_data(t2);
-	xm_tensor_free_block_data(t2new);
-	xm_tensor_free(f_oo);
-	xm_tensor_free(f_ov);
-	xm_tensor_free(f_vv);
-	xm_tensor_free(f1_vv);
-	xm_tensor_free(f2_oo);
-	xm_tensor_free(f2_ov);
-	xm_tensor_free(f2_vv);
-	xm_tensor_free(f3_oo);
-	xm_tensor_free(d_ov);
-	xm_tensor_free(t1);
-	xm_tensor_free(t1new);
-	xm_tensor_free(i_oooo);
-	xm_tensor_free(i4_oooo);
-	xm_tensor_free(i_ooov);
-	xm_tensor_free(i2a_ooov);
-	xm_tensor_free(i_ovov);
-	xm_tensor_free(i1a_ovov);
-	xm_tensor_free(i_oovv);
-	xm_tensor_free(tt_oovv);
-	xm_tensor_free(i_ovvv);
-	xm_tensor_free(i_vvvv);
-	xm_tensor_free(d_oovv);
-	xm_tensor_free(t2);
-	xm_tensor_free(t2new);
-	xm_block_space_free(bsoo);
-	xm_block_space_free(bsov);
-	xm_block_space_free(bsvv);
-	xm_block_space_free(bsoooo);
-	xm_block_space_free(bsooov);
-	xm_block_space_free(bsovov);
-	xm_block_space_free(bsoovv);
-	xm_block_space_free(bsovvv);
-	xm_block_space_free(bsvvvv);
-	xm_allocator_destroy(allocator);
-	timer_stop(timer);
 #ifdef XM_USE_MPI
-	MPI_Finalize();
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
 #endif
-	return 0;
+	t1prod_init(&p, a, b, c, idxa, idxb, idxc, width);
+	maxa = xm_tensor_get_largest_block_size(a);
+	maxc = xm_tensor_get_largest_block_size(c);
+
+	/* group the blocks of c by their spectator indices */
+	xm_tensor_get_canonical_block_list(c, &blks, &nblks);
+	keys = xmalloc(nblks * sizeof *keys);
+	for (i = 0; i < nblks; i++) {
+		keys[i].i = i;
+		keys[i].key = 0;
+		for (j = p.ns; j-- > 0; ) {
+			k = letter_pos(idxc, p.sl[j]);
+			keys[i].key = keys[i].key * p.nblksc.i[k] +
+			    blks[i].i[k];
+		}
+	}
+	qsort(keys, nblks, sizeof *keys, compare_keyed);
+	grp = xmalloc((nblks + 1) * sizeof *grp);
+	for (i = 0, ng = 0; i < nblks; i++)
+		if (i == 0 || keys[i].key != keys[i-1].key)
+			grp[ng++] = i;
+	grp[ng] = nblks;
+#pragma omp parallel private(g)
+{
+	size_t ldm = pad_width(p.maxm, width), ldk = pad_width(p.maxk, width);
+	double *ablk = xmalloc_aligned(maxa * sizeof *ablk);
+	double *am = xmalloc_aligned(ldm * p.maxk * sizeof *am);
+	double *bm = xmalloc_aligned(ldk * p.xn * sizeof *bm);
+	double *r = xmalloc_aligned(ldm * p.xn * sizeof *r);
+	double *box = xmalloc_aligned(maxc * sizeof *box);
+	double *cblk = xmalloc_aligned(maxc * sizeof *cblk);
+#pragma omp for schedule(dynamic)
+	for (g = 0; g < ng; g++) {
+		xm_dim_t cidx, aidx, adims, kblk;
+		size_t j, k, l, m = 1, ldr, len, rdims[XM_MAX_DIM];
+		size_t adim[XM_MAX_DIM], rd[3], off[3], d[3];
+		int first = 1;
+
+		if ((int)(g % (size_t)nproc) != rank)
+			continue;
+		cidx = blks[keys[grp[g]].i];
+		for (j = 0; j < p.ns; j++) {
+			k = letter_pos(idxc, p.sl[j]);
+			rdims[j] = p.offc[k][cidx.i[k]+1] -
+			    p.offc[k][cidx.i[k]];
+			m *= rdims[j];
+		}
+		ldr = pad_width(m, width);
+		aidx.n = p.na;
+		for (j = 0; j < p.ns; j++)
+			aidx.i[p.perma[j]] = cidx.i[letter_pos(idxc, p.sl[j])];
+		kblk.n = p.nk;
+		for (j = 0; j < p.nk; j++)
+			kblk.i[j] = 0;
+		do {
+			for (j = 0; j < p.nk; j++)
+				aidx.i[p.perma[p.ns+j]] = kblk.i[j];
+			if (xm_tensor_get_block_type(a, aidx) !=
+			    XM_BLOCK_TYPE_ZERO) {
+				adims = xm_tensor_get_block_dims(a, aidx);
+				for (j = 0; j < p.na; j++)
+					adim[j] = adims.i[j];
+#pragma omp critical
+				xm_tensor_read_block(a, aidx, ablk);
+				t1prod_block(&p, aidx, adim, ablk, am, bm, r,
+				    first ? 0 : 1);
+				first = 0;
+			}
+			for (j = 0; j < p.nk; j++) {
+				k = p.perma[p.ns+j];
+				if (++kblk.i[j] < p.nblksa.i[k])
+					break;
+				kblk.i[j] = 0;
+			}
+		} while (j < p.nk);
+		if (first)
+			for (j = 0; j < ldr * p.xn; j++)
+				r[j] = 0;
+		rd[0] = ldr;
+		d[0] = m;
+		off[0] = 0;
+		for (l = grp[g]; l < grp[g+1]; l++) {
+			cidx = blks[keys[l].i];
+			for (j = 0, len = m; j < p.nx; j++) {
+				k = letter_pos(idxc, p.xl[j]);
+				rd[1+j] = p.xdim[j];
+				off[1+j] = p.offc[k][cidx.i[k]];
+				d[1+j] = rdims[p.ns+j] =
+				    p.offc[k][cidx.i[k]+1] - off[1+j];
+				len *= d[1+j];
+			}
+			copy_box(r, rd, off, box, d, 1 + p.nx, 0);
+			permute_block(box, rdims, p.nc, p.permr, cblk);
+			if (be != 0) {
+#pragma omp critical
+				xm_tensor_read_block(c, cidx, box);
+				for (j = 0; j < len; j++)
+					cblk[j] = al * cblk[j] + be * box[j];
+			} else {
+				for (j = 0; j < len; j++)
+					cblk[j] *= al;
+			}
+#pragma omp critical
+			xm_tensor_write_block(c, cidx, cblk);
+		}
+	}
+	free(ablk);
+	free(am);
+	free(bm);
+	free(r);
+	free(box);
+	free(cblk);
+}
+	free(blks);
+	free(keys);
+	free(grp);
+	t1prod_free(&p);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+static void
+contract(xm_scalar_t alpha, const xm_tensor_t *a, const xm_tensor_t *b,
+    xm_scalar_t beta, xm_tensor_t *c, const char *idxa, const char *idxb,
+    const char *idxc, size_t width)
+{
+	if (is_matrix_product(idxa, idxb, idxc))
+		contract_2d(alpha, a, b, beta, c, idxa, idxb, idxc, width);
+	else if (is_t1_product(idxa, idxb, idxc))
+		contract_t1(alpha, a, b, beta, c, idxa, idxb, idxc, width);
+	else if (is_t1_product(idxb, idxa, idxc))
+		contract_t1(alpha, b, a, beta, c, idxb, idxa, idxc, width);
+	else
+		xm_contract(alpha, a, b, beta, c, idxa, idxb, idxc);
+}
+
+/*
+ * Default CCSD equations.  Lines starting with "tensor" declare a tensor
+ * with its index space; "nosym" drops the permutational symmetry of the
+ * space, "integral" marks two-electron integrals and "denominator" marks
+ * orbital energy denominators.  Every other line
+ * is an assignment of a sum of products with optional coefficients.
+ * Products of more than two factors are factorized by the planner.
+ */
+static const char *default_equations =
+"tensor f_oo oo\n"
+"tensor f_ov ov\n"
+"tensor f_vv vv\n"
+"tensor f1_vv vv\n"
+"tensor f2_oo oo\n"
+"tensor f2_ov ov\n"
+"tensor f2_vv vv\n"
+"tensor f3_oo oo\n"
+"tensor d_ov ov denominator\n"
+"tensor t1 ov\n"
+"tensor t1new ov\n"
+"tensor i_oooo oooo integral\n"
+"tensor i4_oooo oooo\n"
+"tensor i_ooov ooov integral\n"
+"tensor i2a_ooov ooov\n"
+"tensor i_ovov ovov integral\n"
+"tensor i1a_ovov ovov\n"
+"tensor i_oovv oovv integral\n"
+"tensor tt_oovv oovv\n"
+"tensor i_ovvv ovvv integral\n"
+"tensor i_vvvv vvvv integral\n"
+"tensor d_oovv oovv denominator\n"
+"tensor t2 oovv\n"
+"tensor t2new oovv\n"
+"f1_vv(ab) = f_vv(ab) - 0.5 i_oovv(ijbc) t2(ijac) + i_ovvv(iacb) t1(ic)\n"
+"f2_ov(ia) = f_ov(ia) + t1(jb) i_oovv(ijab)\n"
+"f3_oo(ij) = f_oo(ij) + f2_ov(ia) t1(ja) + 0.5 i_oovv(ikab) t2(jkab)"
+    " + i_ooov(ikja) t1(ka)\n"
+"t1new(ia) = f_ov(ia) + f1_vv(ab) t1(ib) - f3_oo(ji) t1(ja)"
+    " - i_ovov(ibja) t1(jb) + t2(ijab) f2_ov(jb)"
+    " + 0.5 i_ovvv(jabc) t2(jibc) - 0.5 i_ooov(jkib) t2(jkab)\n"
+"t1new(ia) /= d_ov(ia)\n"
+"i1a_ovov(iajb) = t1(ia) t1(jb)\n"
+"f2_oo(ij) = f_oo(ij) + f_ov(ja) t1(ia) + i_ooov(jkia) t1(ka)"
+    " + i_oovv(jkab) i1a_ovov(iakb) + 0.5 i_oovv(jkab) t2(ikab)\n"
+"f2_vv(ab) = f1_vv(ab) - f_ov(ib) t1(ia) - i_oovv(ijbc) i1a_ovov(iajc)\n"
+"t2new(ijab) = t2(ijab) + 2 t1(ia) t1(jb)\n"
+"i1a_ovov(iajb) = i_ovov(iajb) - i_ovvv(iabc) t1(jc) - i_ooov(ikjb) t1(ka)"
+    " - 0.5 t2new(jkca) i_oovv(ikcb)\n"
+"tt_oovv(ijab) = t2(ijab) + 0.5 t1(ia) t1(jb)\n"
+"i4_oooo(ijkl) = i_oooo(ijkl) + 0.5 i_oovv(klab) tt_oovv(ijab)"
+    " + i_ooov(klia) t1(ja)\n"
+"i2a_ooov(ijka) = i_ooov(ijka) - 0.5 i4_oooo(ijkl) t1(la)"
+    " + 0.5 tt_oovv(ijbc) i_ovvv(kabc) + i_ovov(kaib) t1(jb)\n"
+"t2new(ijab) = i_oovv(ijab) + t2(ijac) f2_vv(bc) - i2a_ooov(ijkb) t1(ka)"
+    " + i1a_ovov(kbic) t2(jkac) + i_ovvv(jcba) t1(ic)"
+    " - t2(ikab) f2_oo(jk) + 0.5 i_vvvv(abcd) tt_oovv(ijcd)"
+    " + 0.5 t2(klab) i4_oooo(ijkl)\n"
+"t2new(ijab) /= d_oovv(ijab)\n"
+"t1(ia) = t1new(ia)\n"
+"t2(ijab) = t2new(ijab)\n"
+"energy = f_ov(ia) t1(ia) + 0.5 i_oovv(ijab) t1(ia) t1(jb)"
+    " + 0.25 i_oovv(ijab) t2(ijab)\n";
+
+/* Tensors needed for the MP2 energy alone. */
+static const char *mp2_equations =
+"tensor f_ov ov\n"
+"tensor d_ov ov denominator\n"
+"tensor t1 ov\n"
+"tensor i_oovv oovv integral\n"
+"tensor d_oovv oovv denominator\n"
+"tensor t2 oovv\n";
+
+/* MP2 virtual-virtual density and the Fock matrix for the frozen natural
+ * orbitals. */
+static const char *fno_equations =
+"tensor f_ov ov\n"
+"tensor d_ov ov denominator\n"
+"tensor t1 ov\n"
+"tensor i_oovv oovv integral\n"
+"tensor d_oovv oovv denominator\n"
+"tensor t2 oovv\n"
+"tensor f_vv vv\n"
+"tensor dm_vv vv\n"
+"dm_vv(ab) = 0.5 t2(ijac) t2(ijbc)\n";
+
+/* Letters of s that are (in != 0) or are not (in == 0) in t, s order. */
+static void
+select_letters(const char *s, const char *t, int in, char *out)
+{
+	for (; *s; s++)
+		if ((strchr(t, *s) != NULL) == in)
+			*out++ = *s;
+	*out = '\0';
+}
+
+#define NSPACES 9
+
+static const char *spaces[NSPACES] = {
+	"oo", "ov", "vv", "oooo", "ooov", "ovov", "oovv", "ovvv", "vvvv"
+};
+
+#define MAX_RANK 6
+
+struct tensor {
+	char name[32];
+	char space[MAX_RANK+1];
+	int nosym, integral, denominator, version, role;
+};
+
+/* Tensors are inputs, amplitudes carried between iterations or temps. */
+enum {
+	ROLE_INPUT, ROLE_AMPLITUDE, ROLE_TEMP
+};
+
+enum {
+	STEP_LABEL, STEP_COPY, STEP_ADD, STEP_CONTRACT, STEP_DIV, STEP_DOT
+};
+
+/*
+ * A contraction with nfused above 1 runs together with the next nfused - 1
+ * steps, all contractions of one tensor, in a single pass over it.
+ */
+struct step {
+	int op;
+	double alpha, beta;
+	int a, b, c;
+	char idxa[MAX_RANK+1], idxb[MAX_RANK+1], idxc[MAX_RANK+1];
+	size_t nfused;
+};
+
+
+static size_t
+space_index(const char *space)
+{
+	size_t i;
+
+	for (i = 0; i < NSPACES; i++)
+		if (strcmp(spaces[i], space) == 0)
+			return i;
+	return NSPACES;
+}
+
+static void
+eqn_error(struct ccsd *cc, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "equations:%d: ", cc->eqnline);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	longjmp(cc->eqnenv, 1);
+}
+
+static int
+find_tensor(struct ccsd *cc, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < cc->ntensors; i++)
+		if (strcmp(cc->tensors[i].name, name) == 0)
+			return (int)i;
+	return -1;
+}
+
+static int
+add_tensor(struct ccsd *cc, const char *name, const char *space, int nosym,
+    int integral)
+{
+	struct tensor *t;
+
+	if (strlen(name) >= sizeof t->name)
+		eqn_error(cc, "tensor name %s is too long", name);
+	if (find_tensor(cc, name) != -1)
+		eqn_error(cc, "tensor %s is already declared", name);
+	cc->tensors = realloc(cc->tensors,
+	    (cc->ntensors + 1) * sizeof *cc->tensors);
+	if (cc->tensors == NULL) {
+		perror("realloc");
+		abort();
+	}
+	t = &cc->tensors[cc->ntensors];
+	strcpy(t->name, name);
+	strcpy(t->space, space);
+	t->nosym = nosym;
+	t->integral = integral;
+	t->denominator = 0;
+	t->version = 0;
+	t->role = ROLE_TEMP;
+	return (int)cc->ntensors++;
+}
+
+static void
+add_step(struct ccsd *cc, int op, double alpha, int a, int b, double beta,
+    int c, const char *idxa, const char *idxb, const char *idxc)
+{
+	struct step *st;
+
+	cc->steps = realloc(cc->steps, (cc->nsteps + 1) * sizeof *cc->steps);
+	if (cc->steps == NULL) {
+		perror("realloc");
+		abort();
+	}
+	st = &cc->steps[cc->nsteps++];
+	st->op = op;
+	st->alpha = alpha;
+	st->beta = beta;
+	st->a = a;
+	st->b = b;
+	st->c = c;
+	strcpy(st->idxa, idxa);
+	strcpy(st->idxb, idxb);
+	strcpy(st->idxc, idxc);
+	st->nfused = 1;
+	if (op != STEP_LABEL && op != STEP_DOT)
+		cc->tensors[c].version++;
+}
+
+struct factor {
+	int t;
+	char idx[MAX_RANK+1];
+};
+
+#define MAX_FACTORS 8
+
+/*
+ * Letters of factors i and j that survive their contraction: those that
+ * appear in the output or in any of the other factors.
+ */
+static void
+kept_letters(const struct factor *f, size_t n, size_t i, size_t j,
+    const char *out, char *kept)
+{
+	char all[2*MAX_RANK+1];
+	size_t k;
+	int keep;
+
+	select_letters(f[j].idx, f[i].idx, 0, all);
+	memmove(all + strlen(f[i].idx), all, strlen(all) + 1);
+	memcpy(all, f[i].idx, strlen(f[i].idx));
+	for (k = 0; all[k]; k++) {
+		size_t m;
+
+		keep = strchr(out, all[k]) != NULL;
+		for (m = 0; m < n && !keep; m++)
+			if (m != i && m != j && strchr(f[m].idx, all[k]))
+				keep = 1;
+		if (keep)
+			*kept++ = all[k];
+	}
+	*kept = '\0';
+}
+
+static double
+letters_size(const char *s, const double *dim)
+{
+	double size = 1;
+
+	for (; *s; s++)
+		size *= dim[(unsigned char)*s];
+	return size;
+}
+
+/* Number of floating-point operations of a binary contraction. */
+static double
+contraction_flops(const char *idxa, const char *idxb, const double *dim)
+{
+	char extra[MAX_RANK+1];
+
+	select_letters(idxb, idxa, 0, extra);
+	return 2 * letters_size(idxa, dim) * letters_size(extra, dim);
+}
+
+/*
+ * Find the order of pairwise contractions of n factors into the output
+ * letters out with the least number of operations, preferring orders
+ * with smaller intermediates on ties.  Stores the first pair to contract
+ * in *pi and *pj and the size of the largest intermediate in *peak.
+ * Returns HUGE_VAL if every order needs an intermediate whose rank is
+ * below 2 or above MAX_RANK.
+ */
+static double
+best_order(const struct factor *f, size_t n, const char *out,
+    const double *dim, double *peak, size_t *pi, size_t *pj)
+{
+	struct factor g[MAX_FACTORS];
+	char kept[2*MAX_RANK+1];
+	double flops, size, best = HUGE_VAL, bestpeak = HUGE_VAL;
+	size_t i, j, k, m, ti, tj;
+
+	*pi = 0;
+	*pj = 1;
+	*peak = 0;
+	if (n == 2)
+		return contraction_flops(f[0].idx, f[1].idx, dim);
+	for (i = 0; i < n; i++) {
+	for (j = i + 1; j < n; j++) {
+		kept_letters(f, n, i, j, out, kept);
+		/* intermediates are tensors of rank 2 or more */
+		if (strlen(kept) < 2 || strlen(kept) > MAX_RANK)
+			continue;
+		for (k = 0, m = 0; k < n; k++)
+			if (k != j)
+				g[m++] = f[k];
+		g[i].t = -1;
+		strcpy(g[i].idx, kept);
+		flops = contraction_flops(f[i].idx, f[j].idx, dim) +
+		    best_order(g, n - 1, out, dim, &size, &ti, &tj);
+		if (size < letters_size(kept, dim))
+			size = letters_size(kept, dim);
+		if (flops < best || (flops == best && size < bestpeak)) {
+			best = flops;
+			bestpeak = size;
+			*pi = i;
+			*pj = j;
+		}
+	}}
+	*peak = bestpeak;
+	return best;
+}
+
+struct shared {
+	char key[128];
+	int t;
+};
+
+/*
+ * Return an intermediate holding the contraction of two factors, reusing
+ * an identical one computed earlier if neither operand has been written
+ * since.
+ */
+static int
+intermediate(struct ccsd *cc, const struct factor *fa, const struct factor *fb,
+    const char *kept, const char *letterspace, const double *dim)
+{
+	char key[128], map[128], space[MAX_RANK+1], name[32];
+	char ia[MAX_RANK+1], ib[MAX_RANK+1], ic[MAX_RANK+1];
+	const char *s;
+	size_t i;
+	int t, next = 'a';
+
+	memset(map, 0, sizeof map);
+	for (s = fa->idx; *s; s++)
+		if (!map[(unsigned char)*s])
+			map[(unsigned char)*s] = (char)next++;
+	for (s = fb->idx; *s; s++)
+		if (!map[(unsigned char)*s])
+			map[(unsigned char)*s] = (char)next++;
+	for (i = 0; fa->idx[i]; i++)
+		ia[i] = map[(unsigned char)fa->idx[i]];
+	ia[i] = '\0';
+	for (i = 0; fb->idx[i]; i++)
+		ib[i] = map[(unsigned char)fb->idx[i]];
+	ib[i] = '\0';
+	for (i = 0; kept[i]; i++)
+		ic[i] = map[(unsigned char)kept[i]];
+	ic[i] = '\0';
+	snprintf(key, sizeof key, "%d.%d(%s)%d.%d(%s)(%s)", fa->t,
+	    cc->tensors[fa->t].version, ia, fb->t, cc->tensors[fb->t].version,
+	    ib, ic);
+	for (i = 0; i < cc->nshared; i++)
+		if (strcmp(cc->shared[i].key, key) == 0)
+			return cc->shared[i].t;
+	for (i = 0; kept[i]; i++)
+		space[i] = letterspace[(unsigned char)kept[i]];
+	space[i] = '\0';
+	snprintf(name, sizeof name, "_x%zu", cc->nshared);
+	t = add_tensor(cc, name, space, 1, 0);
+	add_step(cc, STEP_CONTRACT, 1, fa->t, fb->t, 0, t, fa->idx, fb->idx,
+	    kept);
+	cc->flops += contraction_flops(fa->idx, fb->idx, dim);
+	cc->shared = realloc(cc->shared,
+	    (cc->nshared + 1) * sizeof *cc->shared);
+	if (cc->shared == NULL) {
+		perror("realloc");
+		abort();
+	}
+	strcpy(cc->shared[cc->nshared].key, key);
+	cc->shared[cc->nshared++].t = t;
+	return t;
+}
+
+/*
+ * Emit the steps for one term coef * f[0] * ... * f[n-1] added to the
+ * target c with the output letters out.  The target is overwritten if
+ * first is set.  A negative c denotes the energy.
+ */
+static void
+compile_term(struct ccsd *cc, int c, const char *out, double coef,
+    struct factor *f, size_t n, int first, const char *letterspace,
+    const double *dim)
+{
+	char kept[2*MAX_RANK+1];
+	double peak;
+	size_t i, j;
+
+	if (n == 1) {
+		if (c < 0)
+			eqn_error(cc, "energy term needs two factors");
+		add_step(cc, first ? STEP_COPY : STEP_ADD, coef, f[0].t, -1, 0,
+		    c, f[0].idx, "", out);
+		return;
+	}
+	while (n > 2) {
+		if (best_order(f, n, out, dim, &peak, &i, &j) == HUGE_VAL)
+			eqn_error(cc, "cannot factorize a product of %zu "
+			    "tensors", n);
+		kept_letters(f, n, i, j, out, kept);
+		f[i].t = intermediate(cc, &f[i], &f[j], kept, letterspace, dim);
+		strcpy(f[i].idx, kept);
+		memmove(f + j, f + j + 1, (n - j - 1) * sizeof *f);
+		n--;
+	}
+	cc->flops += contraction_flops(f[0].idx, f[1].idx, dim);
+	if (c < 0)
+		add_step(cc, STEP_DOT, coef, f[0].t, f[1].t, first ? 0 : 1, -1,
+		    f[0].idx, f[1].idx, "");
+	else
+		add_step(cc, STEP_CONTRACT, coef, f[0].t, f[1].t, first ? 0 : 1,
+		    c, f[0].idx, f[1].idx, out);
+}
+
+static void
+skip_space(const char **p)
+{
+	while (**p == ' ' || **p == '\t')
+		(*p)++;
+}
+
+static int
+parse_name(struct ccsd *cc, const char **p, char *name, size_t size)
+{
+	size_t n = 0;
+
+	skip_space(p);
+	if (!isalpha((unsigned char)**p) && **p != '_')
+		return 0;
+	while (isalnum((unsigned char)**p) || **p == '_') {
+		if (n + 1 >= size)
+			eqn_error(cc, "name is too long");
+		name[n++] = *(*p)++;
+	}
+	name[n] = '\0';
+	return 1;
+}
+
+static void
+parse_index(struct ccsd *cc, const char **p, int t, char *idx,
+    char *letterspace)
+{
+	size_t n = 0;
+
+	skip_space(p);
+	if (**p != '(')
+		eqn_error(cc, "expected ( after %s", cc->tensors[t].name);
+	for ((*p)++; isalpha((unsigned char)**p); (*p)++) {
+		if (n >= strlen(cc->tensors[t].space))
+			eqn_error(cc, "too many indices for %s",
+			    cc->tensors[t].name);
+		if (memchr(idx, **p, n) != NULL)
+			eqn_error(cc, "repeated index %c in %s", **p,
+			    cc->tensors[t].name);
+		if (letterspace[(unsigned char)**p] &&
+		    letterspace[(unsigned char)**p] != cc->tensors[t].space[n])
+			eqn_error(cc, "index %c spans different spaces", **p);
+		letterspace[(unsigned char)**p] = cc->tensors[t].space[n];
+		idx[n++] = **p;
+	}
+	idx[n] = '\0';
+	if (**p != ')')
+		eqn_error(cc, "expected ) after indices of %s",
+		    cc->tensors[t].name);
+	(*p)++;
+	if (n != strlen(cc->tensors[t].space))
+		eqn_error(cc, "too few indices for %s", cc->tensors[t].name);
+}
+
+static void
+parse_declaration(struct ccsd *cc, const char *p)
+{
+	char name[32], space[16], flag[16];
+	int nosym = 0, integral = 0, denominator = 0;
+	size_t i;
+
+	if (!parse_name(cc, &p, name, sizeof name) ||
+	    !parse_name(cc, &p, space, sizeof space))
+		eqn_error(cc, "expected tensor name and space");
+	if (strlen(space) < 2 || strlen(space) > MAX_RANK)
+		eqn_error(cc, "unsupported rank of %s", name);
+	for (i = 0; space[i]; i++)
+		if (space[i] != 'o' && space[i] != 'v')
+			eqn_error(cc, "bad space %s", space);
+	while (parse_name(cc, &p, flag, sizeof flag)) {
+		if (strcmp(flag, "nosym") == 0)
+			nosym = 1;
+		else if (strcmp(flag, "integral") == 0)
+			integral = 1;
+		else if (strcmp(flag, "denominator") == 0)
+			denominator = 1;
+		else
+			eqn_error(cc, "unknown flag %s", flag);
+	}
+	skip_space(&p);
+	if (*p != '\0')
+		eqn_error(cc, "junk after declaration of %s", name);
+	if (!nosym && space_index(space) == NSPACES)
+		eqn_error(cc, "no symmetry is known for space %s", space);
+	i = (size_t)add_tensor(cc, name, space, nosym, integral);
+	cc->tensors[i].denominator = denominator;
+}
+
+static void
+parse_statement(struct ccsd *cc, const char *p)
+{
+	struct factor f[MAX_FACTORS];
+	char name[32], out[MAX_RANK+1] = "", letterspace[128];
+	double dim[128], coef, sign;
+	int c = -1, first, op;
+	size_t i, n, nterms = 0;
+
+	if (!parse_name(cc, &p, name, sizeof name))
+		eqn_error(cc, "expected assignment");
+	memset(letterspace, 0, sizeof letterspace);
+	if (strcmp(name, "energy") != 0) {
+		if ((c = find_tensor(cc, name)) == -1)
+			eqn_error(cc, "unknown tensor %s", name);
+		parse_index(cc, &p, c, out, letterspace);
+	}
+	skip_space(&p);
+	op = *p;
+	if (op != '=' && !((op == '+' || op == '-' || op == '/') &&
+	    p[1] == '='))
+		eqn_error(cc, "expected =, +=, -= or /=");
+	p += op == '=' ? 1 : 2;
+	first = op == '=';
+	if (first && c >= 0)
+		add_step(cc, STEP_LABEL, 0, -1, -1, 0, c, "", "", "");
+	for (;;) {
+		char letters[128];
+		const char *s;
+
+		skip_space(&p);
+		if (*p == '\0')
+			break;
+		sign = op == '-' ? -1 : 1;
+		if (*p == '+' || *p == '-') {
+			sign *= *p == '-' ? -1 : 1;
+			p++;
+			skip_space(&p);
+		} else if (nterms > 0)
+			eqn_error(cc, "expected + or - between terms");
+		coef = 1;
+		if (isdigit((unsigned char)*p) || *p == '.') {
+			char *end;
+
+			coef = strtod(p, &end);
+			p = end;
+			skip_space(&p);
+			if (*p == '*')
+				p++;
+		}
+		for (n = 0; parse_name(cc, &p, name, sizeof name); n++) {
+			if (n == MAX_FACTORS)
+				eqn_error(cc, "too many factors in a term");
+			if ((f[n].t = find_tensor(cc, name)) == -1)
+				eqn_error(cc, "unknown tensor %s", name);
+			if (f[n].t == c)
+				eqn_error(cc, "%s appears on both sides", name);
+			parse_index(cc, &p, f[n].t, f[n].idx, letterspace);
+			skip_space(&p);
+			if (*p == '*')
+				p++;
+		}
+		if (n == 0)
+			eqn_error(cc, "expected a tensor");
+		memset(letters, 0, sizeof letters);
+		for (i = 0; i < n; i++)
+			for (s = f[i].idx; *s; s++)
+				letters[(unsigned char)*s]++;
+		for (i = 0; i < sizeof letters; i++) {
+			int inout = strchr(out, (int)i) != NULL && i != 0;
+
+			if (letters[i] != 0 && letters[i] + inout != 2)
+				eqn_error(cc, "index %c must appear exactly "
+				    "twice", (int)i);
+			if (inout && letters[i] == 0)
+				eqn_error(cc, "index %c is missing", (int)i);
+		}
+		if (op == '/') {
+			if (n != 1 || coef != 1 || sign != 1 || nterms > 0)
+				eqn_error(cc, "/= takes a single tensor");
+			add_step(cc, STEP_DIV, 1, f[0].t, -1, 0, c, f[0].idx,
+			    "", out);
+			nterms++;
+			continue;
+		}
+		for (i = 0; i < sizeof dim / sizeof *dim; i++)
+			dim[i] = letterspace[i] == 'o' ? 2.0 * cc->o :
+			    2.0 * cc->v;
+		compile_term(cc, c, out, sign * coef, f, n, first, letterspace,
+		    dim);
+		first = 0;
+		nterms++;
+	}
+	if (nterms == 0)
+		eqn_error(cc, "empty right-hand side");
+}
+
+/*
+ * Translate the equations into the list of steps of one iteration.
+ * Returns -1 after printing the first error.
+ */
+static int
+compile_equations(struct ccsd *cc, const char *text)
+{
+	char *buf, *line, *next, *hash;
+	const char *p;
+
+	buf = xmalloc(strlen(text) + 1);
+	strcpy(buf, text);
+	if (setjmp(cc->eqnenv) != 0) {
+		free(buf);
+		return -1;
+	}
+	for (line = buf, cc->eqnline = 1; line != NULL; line = next,
+	    cc->eqnline++) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		if ((hash = strchr(line, '#')) != NULL)
+			*hash = '\0';
+		p = line;
+		skip_space(&p);
+		if (*p == '\0')
+			continue;
+		if (strncmp(p, "tensor", 6) == 0 && (p[6] == ' ' ||
+		    p[6] == '\t'))
+			parse_declaration(cc, p + 6);
+		else
+			parse_statement(cc, p);
+	}
+	free(buf);
+	return 0;
+}
+
+/*
+ * An uppercase O stands for the occupied orbitals including the frozen
+ * core and an uppercase V for the virtuals before the FNO truncation.
+ */
+static xm_block_space_t *
+create_block_space(struct ccsd *cc, const char *space)
+{
+	xm_block_space_t *bs;
+	xm_dim_t dims;
+	size_t i;
+
+	dims.n = strlen(space);
+	for (i = 0; i < dims.n; i++)
+		dims.i[i] = space[i] == 'o' ? 2*cc->o :
+		    space[i] == 'O' ? 2*cc->nocc :
+		    space[i] == 'V' ? 2*cc->vfull : 2*cc->v;
+	bs = xm_block_space_create(dims);
+	split_block_space(cc, bs);
+	return bs;
+}
+
+static size_t
+count_blocks(struct ccsd *cc, size_t dim)
+{
+	size_t nblks, *edges;
+
+	edges = xmalloc(dim * sizeof *edges);
+	nblks = block_edges(dim, cc->blocksize, cc->vecwidth, edges);
+	free(edges);
+	return nblks;
+}
+
+static void
+init_tensor(xm_tensor_t *t, const char *space, size_t ob, size_t vb)
+{
+	if (strcmp(space, "oo") == 0)
+		init_oo(ob, vb, t);
+	else if (strcmp(space, "ov") == 0)
+		init_ov(ob, vb, t);
+	else if (strcmp(space, "vv") == 0)
+		init_oo(vb, ob, t);
+	else if (strcmp(space, "oooo") == 0)
+		init_oooo(ob, vb, t);
+	else if (strcmp(space, "ooov") == 0)
+		init_ooov(ob, vb, t);
+	else if (strcmp(space, "ovov") == 0)
+		init_ovov(ob, vb, t);
+	else if (strcmp(space, "oovv") == 0)
+		init_oovv(ob, vb, t);
+	else if (strcmp(space, "ovvv") == 0)
+		init_ovvv(ob, vb, vb, t);
+	else if (strcmp(space, "vvvv") == 0)
+		init_oooo(vb, ob, t);
+}
+
+/* Make every block of a tensor without symmetry canonical. */
+static void
+init_nosym(xm_tensor_t *t)
+{
+	xm_dim_t nblks, idx;
+	size_t i, k, n;
+
+	nblks = xm_tensor_get_nblocks(t);
+	idx = nblks;
+	for (i = 0; i < idx.n; i++)
+		idx.i[i] = 0;
+	n = xm_dim_dot(&nblks);
+	for (k = 0; k < n; k++) {
+		xm_tensor_set_canonical_block(t, idx);
+		for (i = 0; i < idx.n && ++idx.i[i] == nblks.i[i]; i++)
+			idx.i[i] = 0;
+	}
+}
+
+static double
+tensor_bytes(struct ccsd *cc, int t)
+{
+	const char *s;
+	double size = sizeof(double);
+
+	for (s = cc->tensors[t].space; *s; s++)
+		size *= *s == 'o' ? 2*cc->o : 2*cc->v;
+	return size;
+}
+
+/* Check that s is x followed by y or y followed by x. */
+static int
+is_unfolded(const char *s, const char *x, const char *y)
+{
+	size_t nx = strlen(x), ny = strlen(y);
+
+	return (strncmp(s, x, nx) == 0 && strcmp(s + nx, y) == 0) ||
+	    (strncmp(s, y, ny) == 0 && strcmp(s + ny, x) == 0);
+}
+
+/*
+ * Estimate the number of bytes permuted to bring the operands of a
+ * contraction into matrix form for GEMM.
+ */
+static double
+transpose_cost(const char *idxa, const char *idxb, const char *idxc,
+    double sa, double sb, double sc)
+{
+	char fa[8], fb[8], ka[8], kb[8], ca[8], cb[8];
+	int pa, pb, pc;
+
+	select_letters(idxa, idxb, 0, fa);
+	select_letters(idxb, idxa, 0, fb);
+	select_letters(idxa, idxb, 1, ka);
+	select_letters(idxb, idxa, 1, kb);
+	select_letters(idxc, idxa, 1, ca);
+	select_letters(idxc, idxb, 1, cb);
+	pa = !is_unfolded(idxa, fa, ka);
+	pb = !is_unfolded(idxb, fb, kb);
+	pc = !is_unfolded(idxc, ca, cb);
+	if (!pa && !pb && strcmp(ka, kb) != 0)
+		*(sa < sb ? &pa : &pb) = 1;
+	if (!pa && !pc && strcmp(ca, fa) != 0)
+		*(sa < sc ? &pa : &pc) = 1;
+	if (!pb && !pc && strcmp(cb, fb) != 0)
+		*(sb < sc ? &pb : &pc) = 1;
+	return pa * sa + pb * sb + pc * sc;
+}
+
+static int
+step_reads(const struct step *st, int t)
+{
+	switch (st->op) {
+	case STEP_COPY:
+		return st->a == t;
+	case STEP_ADD:
+	case STEP_DIV:
+		return st->a == t || st->c == t;
+	case STEP_CONTRACT:
+		return st->a == t || st->b == t ||
+		    (st->beta != 0 && st->c == t);
+	case STEP_DOT:
+		return st->a == t || st->b == t;
+	}
+	return 0;
+}
+
+static int
+step_writes(const struct step *st, int t)
+{
+	return st->op != STEP_LABEL && st->op != STEP_DOT && st->c == t;
+}
+
+/*
+ * Estimate the bytes permuted by contraction step st.  The 2-index and
+ * t1 products gather their operands themselves and cost nothing here.
+ */
+static double
+step_cost(struct ccsd *cc, const struct step *st)
+{
+	if (st->op != STEP_CONTRACT ||
+	    is_matrix_product(st->idxa, st->idxb, st->idxc) ||
+	    is_t1_product(st->idxa, st->idxb, st->idxc) ||
+	    is_t1_product(st->idxb, st->idxa, st->idxc))
+		return 0;
+	return transpose_cost(st->idxa, st->idxb, st->idxc,
+	    tensor_bytes(cc, st->a), tensor_bytes(cc, st->b),
+	    tensor_bytes(cc, st->c));
+}
+
+/* Step to the next permutation of n elements; returns 0 after the last. */
+static int
+next_perm(size_t *p, size_t n)
+{
+	size_t i, j, x;
+
+	for (i = n - 1; i > 0 && p[i-1] > p[i]; i--)
+		;
+	if (i == 0)
+		return 0;
+	for (j = n - 1; p[j] < p[i-1]; j--)
+		;
+	x = p[i-1];
+	p[i-1] = p[j];
+	p[j] = x;
+	for (j = n - 1; i < j; i++, j--) {
+		x = p[i];
+		p[i] = p[j];
+		p[j] = x;
+	}
+	return 1;
+}
+
+/* Replace idx with the letters idx[perm[0]], idx[perm[1]], ... */
+static void
+permute_idx(char *idx, const size_t *perm)
+{
+	char tmp[MAX_RANK+1];
+	size_t i, n = strlen(idx);
+
+	for (i = 0; i < n; i++)
+		tmp[i] = idx[perm[i]];
+	tmp[n] = '\0';
+	strcpy(idx, tmp);
+}
+
+/*
+ * Store dimension k of tensor t where dimension perm[k] was and rewrite
+ * the index strings of every step that uses it.
+ */
+static void
+relayout(struct ccsd *cc, int t, const size_t *perm)
+{
+	struct step *st;
+	size_t i;
+
+	permute_idx(cc->tensors[t].space, perm);
+	for (i = 0; i < cc->nsteps; i++) {
+		st = &cc->steps[i];
+		if (st->op == STEP_LABEL)
+			continue;
+		if (st->a == t)
+			permute_idx(st->idxa, perm);
+		if ((st->op == STEP_CONTRACT || st->op == STEP_DOT) &&
+		    st->b == t)
+			permute_idx(st->idxb, perm);
+		if (st->op != STEP_DOT && st->c == t)
+			permute_idx(st->idxc, perm);
+	}
+}
+
+/*
+ * Pick the storage order of the intermediate t that minimizes the
+ * estimated permutation traffic of the steps that produce and read it.
+ */
+static void
+order_intermediate(struct ccsd *cc, int t)
+{
+	size_t i, n, perm[MAX_RANK], best[MAX_RANK], inv[MAX_RANK];
+	double cost, mincost = HUGE_VAL;
+
+	n = strlen(cc->tensors[t].space);
+	for (i = 0; i < n; i++)
+		perm[i] = i;
+	do {
+		relayout(cc, t, perm);
+		for (i = 0, cost = 0; i < cc->nsteps; i++)
+			cost += step_cost(cc, &cc->steps[i]);
+		if (cost < mincost) {
+			mincost = cost;
+			memcpy(best, perm, n * sizeof *perm);
+		}
+		for (i = 0; i < n; i++)
+			inv[perm[i]] = i;
+		relayout(cc, t, inv);
+	} while (next_perm(perm, n));
+	relayout(cc, t, best);
+}
+
+/*
+ * Consider the contractions in steps [first, last) that read tensor t as
+ * an operand.  If copying t into a temporary with another index order
+ * saves more traffic than the copy costs, insert that copy before the
+ * first of them and let them read the temporary.  An input is copied
+ * once by a setup step run after loading, which costs nothing per
+ * iteration.  Returns the number of steps inserted.
+ */
+static size_t
+reorder_reads(struct ccsd *cc, int t, size_t first, size_t last)
+{
+	struct step *st, tmp;
+	char name[32], idx[MAX_RANK+1], space[MAX_RANK+1];
+	size_t i, n, perm[MAX_RANK], best[MAX_RANK], at = last;
+	double base = 0, cost, mincost;
+	int r, once = cc->tensors[t].role == ROLE_INPUT;
+
+	for (i = first; i < last; i++) {
+		st = &cc->steps[i];
+		if (st->op != STEP_CONTRACT || (st->a != t && st->b != t))
+			continue;
+		base += step_cost(cc, st);
+		if (at == last)
+			at = i;
+	}
+	if (base == 0)
+		return 0;
+	n = strlen(cc->tensors[t].space);
+	for (i = 0; i < n; i++)
+		perm[i] = i;
+	mincost = base;
+	while (next_perm(perm, n)) {
+		cost = once ? 0 : tensor_bytes(cc, t);
+		for (i = at; i < last; i++) {
+			tmp = cc->steps[i];
+			if (tmp.op != STEP_CONTRACT ||
+			    (tmp.a != t && tmp.b != t))
+				continue;
+			if (tmp.a == t)
+				permute_idx(tmp.idxa, perm);
+			if (tmp.b == t)
+				permute_idx(tmp.idxb, perm);
+			cost += step_cost(cc, &tmp);
+		}
+		if (cost < mincost) {
+			mincost = cost;
+			memcpy(best, perm, n * sizeof *perm);
+		}
+	}
+	if (mincost == base)
+		return 0;
+	for (i = 0; i < n; i++)
+		idx[i] = (char)('a' + i);
+	idx[n] = '\0';
+	strcpy(space, cc->tensors[t].space);
+	permute_idx(space, best);
+	snprintf(name, sizeof name, "_r%zu", cc->ntensors);
+	r = add_tensor(cc, name, space, 1, 0);
+	for (i = at; i < last; i++) {
+		st = &cc->steps[i];
+		if (st->op != STEP_CONTRACT || (st->a != t && st->b != t))
+			continue;
+		if (st->a == t) {
+			st->a = r;
+			permute_idx(st->idxa, best);
+		}
+		if (st->b == t) {
+			st->b = r;
+			permute_idx(st->idxb, best);
+		}
+	}
+	strcpy(name, idx);
+	permute_idx(name, best);
+	add_step(cc, STEP_COPY, 1, t, -1, 0, r, idx, "", name);
+	if (once)
+		at = cc->nsetup++;
+	tmp = cc->steps[cc->nsteps-1];
+	memmove(cc->steps + at + 1, cc->steps + at,
+	    (cc->nsteps - 1 - at) * sizeof *cc->steps);
+	cc->steps[at] = tmp;
+	return 1;
+}
+
+/*
+ * Choose the storage order of the intermediates the factorization made,
+ * then copy tensors into a better order for the contractions that read
+ * them between two writes where the estimated permutation traffic saved
+ * exceeds the copy.  The copies have no symmetry, so they trade memory
+ * for the traffic.
+ */
+static void
+plan_layout(struct ccsd *cc)
+{
+	size_t i, j, t, ntensors = cc->ntensors;
+	double before = 0, after = 0;
+
+	for (i = 0; i < cc->nsteps; i++)
+		before += step_cost(cc, &cc->steps[i]);
+	for (t = 0; t < ntensors; t++)
+		if (cc->tensors[t].name[0] == '_')
+			order_intermediate(cc, (int)t);
+	/* each value of t is read up to the step that overwrites it */
+	for (t = 0; t < ntensors; t++) {
+		if (cc->tensors[t].name[0] == '_')
+			continue;
+		for (i = j = 0; j < cc->nsteps; j++) {
+			if (!step_writes(&cc->steps[j], (int)t) &&
+			    j + 1 < cc->nsteps)
+				continue;
+			j += reorder_reads(cc, (int)t, i, j + 1);
+			i = j + 1;
+		}
+	}
+	for (i = cc->nsetup; i < cc->nsteps; i++) {
+		after += step_cost(cc, &cc->steps[i]);
+		if (cc->steps[i].c >= (int)ntensors)
+			after += tensor_bytes(cc, cc->steps[i].a);
+	}
+	print("layout planner: estimated transposes %.1f MB -> %.1f MB per "
+	    "iteration, %zu reorders, %zu of them once\n", before / 1048576,
+	    after / 1048576, cc->ntensors - ntensors, cc->nsetup);
+}
+
+/* Check whether two steps can be executed in either order. */
+static int
+steps_commute(const struct step *x, const struct step *y)
+{
+	if (x->op == STEP_LABEL || y->op == STEP_LABEL)
+		return 1;
+	/* both set or accumulate the energy */
+	if (x->op == STEP_DOT && y->op == STEP_DOT)
+		return 0;
+	/* accumulations into the same tensor */
+	if (x->op == STEP_CONTRACT && y->op == STEP_CONTRACT &&
+	    x->c == y->c && x->beta == 1 && y->beta == 1)
+		return x->a != x->c && x->b != x->c &&
+		    y->a != y->c && y->b != y->c;
+	return !step_writes(x, y->a) && !step_writes(x, y->b) &&
+	    !step_writes(x, y->c) && !step_reads(x, y->c) &&
+	    !step_writes(y, x->a) && !step_writes(y, x->b);
+}
+
+static int
+is_consumer(const struct step *st, int x)
+{
+	return st->op != STEP_LABEL && (st->a == x || st->b == x);
+}
+
+/*
+ * Reorder the steps so that the consumers of tensor x run back to back,
+ * keeping every dependency between steps.  A step moves together with
+ * the labels in front of it.  Each consumer is merged with the preceding
+ * group of consumers when the steps between them can be split into those
+ * that the group may pass and those that the consumer may pass.  Returns
+ * the number of runs of consecutive consumers before and after.
+ */
+static void
+schedule_consumers(struct step *steps, size_t nsteps, int x,
+    size_t *before, size_t *after)
+{
+	struct step *tmp;
+	size_t *first, *u, *v, n = 0, i, j, k, p, pmin, pmax, gs = 0, ge = 0;
+
+	first = xmalloc((nsteps + 1) * sizeof *first);
+	u = xmalloc(nsteps * sizeof *u);
+	v = xmalloc(nsteps * sizeof *v);
+	for (i = 0; i < nsteps; i++)
+		if (i == 0 || steps[i-1].op != STEP_LABEL)
+			first[n++] = i;
+	first[n] = nsteps;
+	for (i = 0; i < n; i++)
+		u[i] = i;
+#define UNIT(k) (&steps[first[u[k]+1]-1])
+	*before = *after = 0;
+	for (j = 0; j < n; j++) {
+		if (!is_consumer(UNIT(j), x))
+			continue;
+		(*before)++;
+		if (ge == 0) {
+			gs = j;
+			ge = j + 1;
+			(*after)++;
+			continue;
+		}
+		for (pmax = 0; ge + pmax < j; pmax++) {
+			for (k = gs; k < ge; k++)
+				if (!steps_commute(UNIT(k), UNIT(ge+pmax)))
+					break;
+			if (k < ge)
+				break;
+		}
+		for (pmin = j - ge; pmin > 0; pmin--)
+			if (!steps_commute(UNIT(ge+pmin-1), UNIT(j)))
+				break;
+		if (pmin > pmax) {
+			gs = j;
+			ge = j + 1;
+			(*after)++;
+			continue;
+		}
+		p = pmin;
+		for (i = 0; i < p; i++)
+			v[i] = u[ge+i];
+		for (k = gs; k < ge; k++)
+			v[i++] = u[k];
+		v[i++] = u[j];
+		for (k = ge + p; k < j; k++)
+			v[i++] = u[k];
+		memcpy(u + gs, v, i * sizeof *v);
+		k = ge - gs;
+		gs += p;
+		ge = gs + k + 1;
+	}
+#undef UNIT
+	tmp = xmalloc(nsteps * sizeof *tmp);
+	for (i = 0, k = 0; i < n; i++)
+		for (j = first[u[i]]; j < first[u[i]+1]; j++)
+			tmp[k++] = steps[j];
+	memcpy(steps, tmp, nsteps * sizeof *tmp);
+	free(tmp);
+	free(first);
+	free(u);
+	free(v);
+}
+
+/*
+ * Check whether step st contracts tensor x with a 2-index tensor and
+ * return the index strings of x and of the other operand.
+ */
+static int
+is_t1_consumer(const struct step *st, int x, const char **ix,
+    const char **io)
+{
+	if (st->op != STEP_CONTRACT || st->a == st->b ||
+	    is_matrix_product(st->idxa, st->idxb, st->idxc))
+		return 0;
+	if (st->a == x && is_t1_product(st->idxa, st->idxb, st->idxc)) {
+		*ix = st->idxa;
+		*io = st->idxb;
+		return 1;
+	}
+	if (st->b == x && is_t1_product(st->idxb, st->idxa, st->idxc)) {
+		*ix = st->idxb;
+		*io = st->idxa;
+		return 1;
+	}
+	return 0;
+}
+
+/* Mask of the dimensions of x that are spectators of step st. */
+static unsigned
+spectator_mask(const struct step *st, int x)
+{
+	const char *ix = st->a == x ? st->idxa : st->idxb;
+	unsigned mask = 0;
+	size_t i;
+
+	for (i = 0; ix[i]; i++)
+		if (strchr(st->idxc, ix[i]) != NULL)
+			mask |= 1u << i;
+	return mask;
+}
+
+/*
+ * Run the n contractions at st of a common tensor x with 2-index tensors
+ * in one pass over x.  The blocks of x are grouped by their indices along
+ * the dimensions that are spectators in every contraction.  Each block of
+ * a group is read once and multiplied into a slab of every output that
+ * holds the output blocks of the group, and these are written when the
+ * group is done.
+ */
+static void
+contract_stream(struct ccsd *cc, const struct step *st, size_t n)
+{
+	struct t1prod *p;
+	const xm_tensor_t *a;
+	const char *ix, *io;
+	xm_dim_t nbx, **blks;
+	struct keyed **keys;
+	size_t **first, *nblks, *slab, gd[XM_MAX_DIM], od[XM_MAX_DIM];
+	size_t g, i, j, k, s, na, ng = 0, no = 0, ngroups = 1, nother = 1;
+	size_t maxa, maxc = 0, maxam = 0, maxbm = 0, maxr = 0, nslab = 0;
+	size_t ldm;
+	unsigned mask = ~0u;
+	int x, rank = 0, nproc = 1;
+
+#ifdef XM_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+#endif
+	x = st[0].a == st[1].a || st[0].a == st[1].b ? st[0].a : st[0].b;
+	a = cc->t[x];
+	nbx = xm_tensor_get_nblocks(a);
+	na = nbx.n;
+	for (s = 0; s < n; s++)
+		mask &= spectator_mask(&st[s], x);
+	for (i = 0; i < na; i++) {
+		if (mask & (1u << i)) {
+			gd[ng++] = i;
+			ngroups *= nbx.i[i];
+		} else {
+			od[no++] = i;
+			nother *= nbx.i[i];
+		}
+	}
+	p = xmalloc(n * sizeof *p);
+	blks = xmalloc(n * sizeof *blks);
+	keys = xmalloc(n * sizeof *keys);
+	first = xmalloc(n * sizeof *first);
+	nblks = xmalloc(n * sizeof *nblks);
+	slab = xmalloc(n * sizeof *slab);
+	for (s = 0; s < n; s++) {
+		xm_tensor_t *c = cc->t[st[s].c];
+		xm_dim_t dimsa = xm_tensor_get_abs_dims(a);
+
+		is_t1_consumer(&st[s], x, &ix, &io);
+		t1prod_init(&p[s], a, cc->t[st[s].a == x ? st[s].b : st[s].a],
+		    c, ix, io, st[s].idxc, cc->vecwidth);
+		ldm = pad_width(p[s].maxm, cc->vecwidth);
+		if (ldm * p[s].maxk > maxam)
+			maxam = ldm * p[s].maxk;
+		if (pad_width(p[s].maxk, cc->vecwidth) * p[s].xn > maxbm)
+			maxbm = pad_width(p[s].maxk, cc->vecwidth) * p[s].xn;
+		if (ldm * p[s].xn > maxr)
+			maxr = ldm * p[s].xn;
+		if (xm_tensor_get_largest_block_size(c) > maxc)
+			maxc = xm_tensor_get_largest_block_size(c);
+		/* slab over the spectators, restricted to the group */
+		for (j = 0, slab[s] = p[s].xn; j < p[s].ns; j++) {
+			k = p[s].perma[j];
+			slab[s] *= mask & (1u << k) ?
+			    max_extent(p[s].offa[k], nbx.i[k]) : dimsa.i[k];
+		}
+		nslab += slab[s];
+		/* order the blocks of c by group */
+		xm_tensor_get_canonical_block_list(c, &blks[s], &nblks[s]);
+		keys[s] = xmalloc(nblks[s] * sizeof **keys);
+		for (i = 0; i < nblks[s]; i++) {
+			keys[s][i].i = i;
+			keys[s][i].key = 0;
+			for (j = ng; j-- > 0; ) {
+				k = letter_pos(st[s].idxc, ix[gd[j]]);
+				keys[s][i].key = keys[s][i].key *
+				    nbx.i[gd[j]] + blks[s][i].i[k];
+			}
+		}
+		qsort(keys[s], nblks[s], sizeof **keys, compare_keyed);
+		first[s] = xmalloc((ngroups + 1) * sizeof **first);
+		for (g = 0, i = 0; g <= ngroups; g++) {
+			while (i < nblks[s] && keys[s][i].key < g)
+				i++;
+			first[s][g] = i;
+		}
+	}
+	maxa = xm_tensor_get_largest_block_size(a);
+#pragma omp parallel private(g)
+{
+	double *ablk = xmalloc_aligned(maxa * sizeof *ablk);
+	double *am = xmalloc_aligned(maxam * sizeof *am);
+	double *bm = xmalloc_aligned(maxbm * sizeof *bm);
+	double *r = xmalloc_aligned(maxr * sizeof *r);
+	double *sl = xmalloc(nslab * sizeof *sl);
+	double *box = xmalloc_aligned(maxc * sizeof *box);
+	double *cblk = xmalloc_aligned(maxc * sizeof *cblk);
+#pragma omp for schedule(dynamic)
+	for (g = 0; g < ngroups; g++) {
+		const struct t1prod *q;
+		xm_dim_t idx, adims, cidx;
+		size_t j, k, l, m, s, col, len, ldr, *offa, *offc;
+		size_t adim[XM_MAX_DIM], rd[XM_MAX_DIM], off[XM_MAX_DIM];
+		size_t d[XM_MAX_DIM];
+		double *y, al, be;
+
+		if ((int)(g % (size_t)nproc) != rank)
+			continue;
+		idx.n = na;
+		for (j = 0, m = g; j < ng; j++) {
+			idx.i[gd[j]] = m % nbx.i[gd[j]];
+			m /= nbx.i[gd[j]];
+		}
+		memset(sl, 0, nslab * sizeof *sl);
+		for (l = 0; l < nother; l++) {
+			for (j = 0, m = l; j < no; j++) {
+				idx.i[od[j]] = m % nbx.i[od[j]];
+				m /= nbx.i[od[j]];
+			}
+			if (xm_tensor_get_block_type(a, idx) ==
+			    XM_BLOCK_TYPE_ZERO)
+				continue;
+			adims = xm_tensor_get_block_dims(a, idx);
+			for (j = 0; j < na; j++)
+				adim[j] = adims.i[j];
+#pragma omp critical
+			xm_tensor_read_block(a, idx, ablk);
+			/* add the block to the slab of every output */
+			for (s = 0, y = sl; s < n; y += slab[s++]) {
+				q = &p[s];
+				ldr = t1prod_block(q, idx, adim, ablk, am, bm,
+				    r, 0);
+				for (j = 0; j < q->ns; j++) {
+					k = q->perma[j];
+					offa = q->offa[k];
+					rd[j] = mask & (1u << k) ?
+					    offa[idx.i[k]+1] - offa[idx.i[k]] :
+					    offa[nbx.i[k]];
+					off[j] = mask & (1u << k) ?
+					    0 : offa[idx.i[k]];
+					d[j] = adim[k];
+				}
+				for (j = 0; j < q->nx; j++) {
+					rd[q->ns+j] = q->xdim[j];
+					d[q->ns+j] = 1;
+				}
+				/* one padded column of r at a time */
+				for (col = 0; col < q->xn; col++) {
+					for (j = 0, m = col; j < q->nx; j++) {
+						off[q->ns+j] = m % q->xdim[j];
+						m /= q->xdim[j];
+					}
+					copy_box(y, rd, off, r + col * ldr, d,
+					    q->nc, 2);
+				}
+			}
+		}
+		/* write the blocks of every output in the group */
+		for (s = 0, y = sl; s < n; y += slab[s++]) {
+			q = &p[s];
+			al = st[s].alpha;
+			be = st[s].beta;
+			for (j = 0; j < q->ns; j++) {
+				k = q->perma[j];
+				offa = q->offa[k];
+				rd[j] = mask & (1u << k) ?
+				    offa[idx.i[k]+1] - offa[idx.i[k]] :
+				    offa[nbx.i[k]];
+			}
+			for (j = 0; j < q->nx; j++)
+				rd[q->ns+j] = q->xdim[j];
+			for (l = first[s][g]; l < first[s][g+1]; l++) {
+				cidx = blks[s][keys[s][l].i];
+				for (j = 0, len = 1; j < q->nc; j++) {
+					k = letter_pos(st[s].idxc, j < q->ns ?
+					    q->sl[j] : q->xl[j-q->ns]);
+					offc = q->offc[k];
+					d[j] = offc[cidx.i[k]+1] -
+					    offc[cidx.i[k]];
+					off[j] = j < q->ns && mask &
+					    (1u << q->perma[j]) ?
+					    0 : offc[cidx.i[k]];
+					len *= d[j];
+				}
+				copy_box(y, rd, off, box, d, q->nc, 0);
+				permute_block(box, d, q->nc, q->permr, cblk);
+				if (be != 0) {
+#pragma omp critical
+					xm_tensor_read_block(cc->t[st[s].c],
+					    cidx, box);
+					for (j = 0; j < len; j++)
+						cblk[j] = al * cblk[j] +
+						    be * box[j];
+				} else {
+					for (j = 0; j < len; j++)
+						cblk[j] *= al;
+				}
+#pragma omp critical
+				xm_tensor_write_block(cc->t[st[s].c], cidx,
+				    cblk);
+			}
+		}
+	}
+	free(ablk);
+	free(am);
+	free(bm);
+	free(r);
+	free(sl);
+	free(box);
+	free(cblk);
+}
+	for (s = 0; s < n; s++) {
+		t1prod_free(&p[s]);
+		free(blks[s]);
+		free(keys[s]);
+		free(first[s]);
+	}
+	free(p);
+	free(blks);
+	free(keys);
+	free(first);
+	free(nblks);
+	free(slab);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+/*
+ * Fuse the contractions of tensor x with 2-index tensors that run back to
+ * back with other consumers of x into single passes over x.  A
+ * contraction joins the first one of its run if it writes another tensor,
+ * shares a spectator dimension of x with the others and may move ahead of
+ * the steps in between; it is moved up with its labels.  Returns the
+ * number of contractions that joined a pass.
+ */
+static size_t
+fuse_consumers(struct ccsd *cc, int x)
+{
+	struct step *steps = cc->steps, *tmp;
+	const char *ix, *io;
+	size_t i, j, k, l, m, nfused = 0, *member;
+	unsigned mask, *in;
+
+	member = xmalloc(cc->nsteps * sizeof *member);
+	in = xmalloc(cc->nsteps * sizeof *in);
+	tmp = xmalloc(cc->nsteps * sizeof *tmp);
+	for (i = cc->nsetup; i < cc->nsteps; i++) {
+		if (steps[i].nfused > 1) {
+			i += steps[i].nfused - 1;
+			continue;
+		}
+		if (!is_t1_consumer(&steps[i], x, &ix, &io))
+			continue;
+		mask = spectator_mask(&steps[i], x);
+		memset(in, 0, cc->nsteps * sizeof *in);
+		in[i] = 1;
+		member[0] = i;
+		m = 1;
+		for (j = i + 1; j < cc->nsteps && (steps[j].op == STEP_LABEL ||
+		    is_consumer(&steps[j], x)); j++) {
+			if (steps[j].nfused > 1 ||
+			    !is_t1_consumer(&steps[j], x, &ix, &io) ||
+			    !(mask & spectator_mask(&steps[j], x)))
+				continue;
+			for (k = i; k < j; k++) {
+				if (!steps_commute(&steps[k], &steps[j]))
+					break;
+				if (in[k] && steps[k].c == steps[j].c)
+					break;
+			}
+			if (k < j)
+				continue;
+			mask &= spectator_mask(&steps[j], x);
+			in[j] = 1;
+			member[m++] = j;
+		}
+		if (m < 2)
+			continue;
+		/* labels of the members, the members, then the others */
+		for (k = i + 1; k < j; k++)
+			for (l = k; in[k] == 1 && steps[l-1].op ==
+			    STEP_LABEL && !in[l-1]; l--)
+				in[l-1] = 2;
+		l = 0;
+		for (k = i + 1; k < j; k++)
+			if (in[k] == 2)
+				tmp[l++] = steps[k];
+		i += l;
+		for (k = 0; k < m; k++)
+			tmp[l++] = steps[member[k]];
+		for (k = member[0] + 1; k < j; k++)
+			if (!in[k])
+				tmp[l++] = steps[k];
+		memmove(steps + member[0], tmp, l * sizeof *tmp);
+		steps[i].nfused = m;
+		nfused += m;
+		i += m - 1;
+	}
+	free(member);
+	free(in);
+	free(tmp);
+	return nfused;
+}
+
+/*
+ * Run the consumers of each integral tensor back to back where the
+ * dependencies allow, then fuse the contractions with 2-index tensors in
+ * each run into single passes, so that every block read updates all of
+ * their outputs.  Other consumers still read the whole tensor.
+ */
+static void
+plan_grouping(struct ccsd *cc)
+{
+	size_t i, n, before, after;
+
+	for (i = 0; i < cc->ntensors; i++) {
+		if (!cc->tensors[i].integral)
+			continue;
+		schedule_consumers(cc->steps + cc->nsetup,
+		    cc->nsteps - cc->nsetup, (int)i, &before, &after);
+		print("grouping %s consumers: %zu -> %zu runs\n",
+		    cc->tensors[i].name, before, after);
+	}
+	for (i = 0; i < cc->ntensors; i++) {
+		if (!cc->tensors[i].integral)
+			continue;
+		if ((n = fuse_consumers(cc, (int)i)) > 0)
+			print("streaming %s: %zu consumers in fused passes\n",
+			    cc->tensors[i].name, n);
+	}
+}
+
+/* Run steps first to last - 1. */
+static void
+run_steps(struct ccsd *cc, size_t first, size_t last)
+{
+	const struct step *st;
+	xm_tensor_t **t = cc->t;
+	size_t i;
+
+	for (i = first; i < last; i++) {
+		st = &cc->steps[i];
+		switch (st->op) {
+		case STEP_LABEL:
+			print("%s\n", cc->tensors[st->c].name);
+			break;
+		case STEP_COPY:
+			xm_copy(t[st->c], st->alpha, t[st->a], st->idxc,
+			    st->idxa);
+			break;
+		case STEP_ADD:
+			xm_add(1, t[st->c], st->alpha, t[st->a], st->idxc,
+			    st->idxa);
+			break;
+		case STEP_CONTRACT:
+			if (st->nfused > 1) {
+				contract_stream(cc, st, st->nfused);
+				i += st->nfused - 1;
+				break;
+			}
+			contract(st->alpha, t[st->a], t[st->b], st->beta,
+			    t[st->c], st->idxa, st->idxb, st->idxc,
+			    cc->vecwidth);
+			break;
+		case STEP_DIV:
+			xm_div(t[st->c], t[st->a], st->idxc, st->idxa);
+			break;
+		case STEP_DOT:
+			cc->energy = st->beta * cc->energy + st->alpha *
+			    xm_dot(t[st->a], t[st->b], st->idxa, st->idxb);
+			break;
+		}
+	}
+}
+
+static int
+compare_ptr(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Count for each canonical block of t the nonzero blocks holding its
+ * data, itself included.  Derivative blocks share the data pointer of
+ * their canonical block.
+ */
+static size_t *
+block_weights(const xm_tensor_t *t, const xm_dim_t *blks, size_t nblks)
+{
+	xm_dim_t nb, idx;
+	uint64_t *ptr, p, *lo;
+	size_t i, n, np = 0, *w;
+
+	nb = xm_tensor_get_nblocks(t);
+	n = xm_dim_dot(&nb);
+	ptr = xmalloc(n * sizeof *ptr);
+	idx = xm_dim_zero(nb.n);
+	for (i = 0; i < n; i++) {
+		if (xm_tensor_get_block_type(t, idx) != XM_BLOCK_TYPE_ZERO)
+			ptr[np++] = xm_tensor_get_block_data_ptr(t, idx);
+		xm_dim_inc(&idx, &nb);
+	}
+	qsort(ptr, np, sizeof *ptr, compare_ptr);
+	w = xmalloc(nblks * sizeof *w);
+	for (i = 0; i < nblks; i++) {
+		p = xm_tensor_get_block_data_ptr(t, blks[i]);
+		lo = bsearch(&p, ptr, np, sizeof *ptr, compare_ptr);
+		while (lo > ptr && lo[-1] == p)
+			lo--;
+		for (w[i] = 0; lo + w[i] < ptr + np && lo[w[i]] == p; w[i]++)
+			;
+	}
+	free(ptr);
+	return w;
+}
+
+/*
+ * Set the canonical blocks of out to num / den element by element and
+ * return the full dot product of num and out, accumulated while the
+ * blocks are in memory.  Elements of derivative blocks are plus or minus
+ * those of their canonical block, so each canonical block counts once
+ * per block that holds its data.
+ */
+static double
+divide_blocks(xm_tensor_t *out, const xm_tensor_t *num,
+    const xm_tensor_t *den)
+{
+	xm_dim_t *blks;
+	size_t i, nblks, maxsize, *w;
+	double dot = 0;
+	int rank = 0;
+
+#ifdef XM_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+	xm_tensor_get_canonical_block_list(out, &blks, &nblks);
+	maxsize = xm_tensor_get_largest_block_size(out);
+	w = block_weights(out, blks, nblks);
+#pragma omp parallel private(i)
+{
+	double *nbuf = xmalloc(maxsize * sizeof *nbuf);
+	double *dbuf = xmalloc(maxsize * sizeof *dbuf);
+#pragma omp for schedule(dynamic) reduction(+:dot)
+	for (i = 0; i < nblks; i++) {
+		size_t j, n;
+		double x, sum = 0;
+
+		n = xm_tensor_get_block_size(out, blks[i]);
+#pragma omp critical
+		{
+			xm_tensor_read_block(num, blks[i], nbuf);
+			xm_tensor_read_block(den, blks[i], dbuf);
+		}
+		for (j = 0; j < n; j++) {
+			x = nbuf[j] / dbuf[j];
+			sum += nbuf[j] * x;
+			nbuf[j] = x;
+		}
+		dot += (double)w[i] * sum;
+		if (rank == 0) {
+#pragma omp critical
+			xm_tensor_write_block(out, blks[i], nbuf);
+		}
+	}
+	free(nbuf);
+	free(dbuf);
+}
+	free(blks);
+	free(w);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	return dot;
+}
+
+/* Find a tensor declared with the given space and symmetry or return -1. */
+static int
+find_tensor_in(struct ccsd *cc, const char *name, const char *space)
+{
+	int t;
+
+	if ((t = find_tensor(cc, name)) == -1 || cc->tensors[t].nosym ||
+	    strcmp(cc->tensors[t].space, space) != 0)
+		return -1;
+	return t;
+}
+
+/*
+ * Set t1 = f_ov / d_ov and t2 = i_oovv / d_oovv, reading each integral
+ * block once, and compute the MP2 energy from them.  Returns -1 if the
+ * equations do not declare these tensors.
+ */
+static int
+mp2_amplitudes(struct ccsd *cc)
+{
+	xm_tensor_t **t = cc->t;
+	int t1, t2, fov, dov, ioovv, doovv;
+	time_t timer;
+
+	t1 = find_tensor_in(cc, "t1", "ov");
+	t2 = find_tensor_in(cc, "t2", "oovv");
+	fov = find_tensor_in(cc, "f_ov", "ov");
+	dov = find_tensor_in(cc, "d_ov", "ov");
+	ioovv = find_tensor_in(cc, "i_oovv", "oovv");
+	doovv = find_tensor_in(cc, "d_oovv", "oovv");
+	if (t1 == -1 || t2 == -1 || fov == -1 || dov == -1 || ioovv == -1 ||
+	    doovv == -1)
+		return -1;
+	timer = timer_start("computing mp2 amplitudes");
+	cc->emp2 = divide_blocks(t[t1], t[fov], t[dov]) +
+	    0.25 * divide_blocks(t[t2], t[ioovv], t[doovv]);
+	timer_stop(timer);
+	print("mp2 energy = %.10lf\n", cc->emp2);
+	return 0;
+}
+
+/*
+ * A tensor never written by the iteration is an input.  A tensor read
+ * before it is written carries its value over from the previous iteration.
+ */
+static void
+assign_roles(struct ccsd *cc)
+{
+	size_t i;
+	int t, rd, wr;
+
+	for (t = 0; t < (int)cc->ntensors; t++) {
+		rd = wr = 0;
+		for (i = 0; i < cc->nsteps; i++) {
+			if (!wr && step_reads(&cc->steps[i], t))
+				rd = 1;
+			if (step_writes(&cc->steps[i], t))
+				wr = 1;
+		}
+		cc->tensors[t].role = !wr ? ROLE_INPUT :
+		    rd ? ROLE_AMPLITUDE : ROLE_TEMP;
+	}
+}
+
+static void
+release(struct ccsd *cc)
+{
+	size_t i, j;
+
+	for (i = 0; cc->t != NULL && i < cc->ntensors; i++) {
+		xm_tensor_free_block_data(cc->t[i]);
+		xm_tensor_free(cc->t[i]);
+	}
+	for (i = 0; cc->bs != NULL && i < cc->ntensors; i++) {
+		for (j = 0; j < i; j++)
+			if (cc->bs[j] == cc->bs[i])
+				break;
+		if (j == i)
+			xm_block_space_free(cc->bs[i]);
+	}
+	free(cc->t);
+	free(cc->bs);
+	free(cc->tensors);
+	free(cc->steps);
+	free(cc->shared);
+	cc->t = NULL;
+	cc->bs = NULL;
+	cc->tensors = NULL;
+	cc->steps = NULL;
+	cc->shared = NULL;
+	cc->ntensors = cc->nsteps = cc->nsetup = cc->nshared = 0;
+	cc->flops = 0;
+	cc->ready = cc->warm = 0;
+}
+
+ccsd_t *
+ccsd_create(const char *pagefile)
+{
+	struct ccsd *cc;
+
+	cc = xmalloc(sizeof *cc);
+	memset(cc, 0, sizeof *cc);
+	cc->blocksize = 32;
+	cc->reqwidth = 1;
+	cc->maxtail = 0.1;
+	if ((cc->allocator = xm_allocator_create(pagefile)) == NULL) {
+		free(cc);
+		return NULL;
+	}
+	return cc;
+}
+
+void
+ccsd_set_blocking(ccsd_t *cc, size_t blocksize, size_t vecwidth,
+    double maxtail)
+{
+	cc->blocksize = blocksize;
+	cc->reqwidth = vecwidth;
+	cc->maxtail = maxtail;
+	cc->ready = 0;
+}
+
+int
+ccsd_set_equations(ccsd_t *cc, const char *text)
+{
+	struct ccsd tmp;
+	int rc;
+
+	if (text != NULL) {
+		memset(&tmp, 0, sizeof tmp);
+		tmp.o = tmp.v = 1;
+		rc = compile_equations(&tmp, text);
+		release(&tmp);
+		if (rc != 0)
+			return -1;
+	}
+	free(cc->equations);
+	cc->equations = NULL;
+	if (text != NULL) {
+		cc->equations = xmalloc(strlen(text) + 1);
+		strcpy(cc->equations, text);
+	}
+	cc->ready = 0;
+	return 0;
+}
+
+void
+ccsd_set_planning(ccsd_t *cc, int layout, int grouping)
+{
+	cc->planner = layout;
+	cc->grouping = grouping;
+	cc->ready = 0;
+}
+
+void
+ccsd_set_method(ccsd_t *cc, int method)
+{
+	cc->method = method;
+	cc->ready = 0;
+}
+
+void
+ccsd_set_frozen_core(ccsd_t *cc, size_t ncore)
+{
+	cc->ncore = ncore;
+	cc->ready = 0;
+}
+
+void
+ccsd_set_fno(ccsd_t *cc, double thresh)
+{
+	cc->fno = thresh;
+	cc->ready = 0;
+}
+
+static const char *
+equations_text(struct ccsd *cc)
+{
+	if (cc->method == CCSD_METHOD_MP2)
+		return mp2_equations;
+	return cc->equations ? cc->equations : default_equations;
+}
+
+/* Compile the equations and create the tensors for o by v orbitals. */
+static void
+build(struct ccsd *cc, size_t o, size_t v, const char *text)
+{
+	xm_block_space_t **bs;
+	xm_tensor_t **t;
+	size_t i, j, ob, vb;
+	time_t timer;
+
+	cc->o = o;
+	cc->v = v;
+	cc->vecwidth = cc->reqwidth;
+	choose_vecwidth(cc);
+	print("%s, C1, o %zu, v %zu, blocksize %zu, vector width %zu\n",
+	    cc->method == CCSD_METHOD_MP2 ? "MP2" : "CCSD", o, v,
+	    cc->blocksize, cc->vecwidth);
+	if (cc->ncore > 0)
+		print("frozen core: %zu orbitals\n", cc->ncore);
+	if (cc->vecwidth > 1)
+		print_tail(cc);
+	/* user equations were checked by ccsd_set_equations */
+	if (compile_equations(cc, text) != 0)
+		abort();
+	assign_roles(cc);
+	if (cc->method == CCSD_METHOD_MP2) {
+		cc->tensors[find_tensor(cc, "t1")].role = ROLE_AMPLITUDE;
+		cc->tensors[find_tensor(cc, "t2")].role = ROLE_AMPLITUDE;
+	}
+	print("equations: %zu tensors, %zu steps, %.3lf GFLOP per iteration\n",
+	    cc->ntensors, cc->nsteps, cc->flops / 1e9);
+	if (cc->planner)
+		plan_layout(cc);
+	if (cc->grouping)
+		plan_grouping(cc);
+
+	timer = timer_start("creating the objects");
+	bs = cc->bs = xmalloc(cc->ntensors * sizeof *bs);
+	t = cc->t = xmalloc(cc->ntensors * sizeof *t);
+
+	ob = count_blocks(cc, o);
+	vb = count_blocks(cc, v);
+
+	for (i = 0; i < cc->ntensors; i++) {
+		for (j = 0; j < i; j++)
+			if (strcmp(cc->tensors[j].space,
+			    cc->tensors[i].space) == 0)
+				break;
+		bs[i] = j < i ? bs[j] : create_block_space(cc,
+		    cc->tensors[i].space);
+		t[i] = xm_tensor_create(bs[i], XM_SCALAR_DOUBLE,
+		    cc->allocator);
+		if (cc->tensors[i].nosym)
+			init_nosym(t[i]);
+		else
+			init_tensor(t[i], cc->tensors[i].space, ob, vb);
+	}
+	timer_stop(timer);
+	cc->ready = 1;
+}
+
+void
+ccsd_setup(ccsd_t *cc, size_t o, size_t v)
+{
+	if (cc->ready && cc->nocc == o && cc->nvirt == v)
+		return;
+	if (cc->ncore >= o) {
+		fprintf(stderr, "%zu core orbitals of %zu occupied leave none "
+		    "active\n", cc->ncore, o);
+		abort();
+	}
+	release(cc);
+	cc->nocc = o;
+	cc->nvirt = v;
+	cc->vfull = v;
+	/* with FNO the tensors are built once the virtuals are truncated */
+	if (cc->fno > 0 && cc->method == CCSD_METHOD_CCSD)
+		return;
+	build(cc, o - cc->ncore, v, equations_text(cc));
+}
+
+/*
+ * Replace the symmetric n by n matrix a with its eigenvectors and store
+ * the eigenvalues in ascending order in w.
+ */
+static void
+eigen(size_t n, double *a, double *w)
+{
+	double *work, lw;
+	int nn = (int)n, lwork = -1, info;
+
+	dsyev_("V", "U", &nn, a, &nn, w, &lw, &lwork, &info);
+	lwork = (int)lw;
+	work = xmalloc((size_t)lwork * sizeof *work);
+	dsyev_("V", "U", &nn, a, &nn, w, work, &lwork, &info);
+	free(work);
+	if (info != 0) {
+		fprintf(stderr, "dsyev failed with info %d\n", info);
+		abort();
+	}
+}
+
+/*
+ * Rotate the nv orbitals in the columns of c, given in a basis of n, so
+ * that the n by n Fock matrix f is diagonal in their span, and store
+ * their orbital energies in e.
+ */
+static void
+semicanonicalize(double *c, const double *f, size_t n, size_t nv, double *e)
+{
+	double *fc, *h, *r, one = 1, zero = 0;
+	int nn = (int)n, mm = (int)nv;
+
+	fc = xmalloc(n * nv * sizeof *fc);
+	h = xmalloc(nv * nv * sizeof *h);
+	r = xmalloc(n * nv * sizeof *r);
+	dgemm_("N", "N", &nn, &mm, &nn, &one, f, &nn, c, &nn, &zero, fc, &nn);
+	dgemm_("T", "N", &mm, &mm, &nn, &one, c, &nn, fc, &nn, &zero, h, &mm);
+	eigen(nv, h, e);
+	dgemm_("N", "N", &nn, &mm, &mm, &one, c, &nn, h, &mm, &zero, r, &nn);
+	memcpy(c, r, n * nv * sizeof *c);
+	free(fc);
+	free(h);
+	free(r);
+}
+
+/*
+ * Compute the MP2 frozen natural orbitals in the full virtual space and
+ * keep those with occupation above the threshold.  The kept orbitals are
+ * then made semicanonical and stored as the columns of cc->fnovec with
+ * their orbital energies in cc->evir.  Returns their number.
+ */
+static size_t
+fno_vectors(struct ccsd *cc, ccsd_load_fn load, void *arg)
+{
+	struct ccsd *mp;
+	double *dm, *fm, *a, *f, *w;
+	size_t i, j, v = cc->vfull, nv;
+
+	mp = xmalloc(sizeof *mp);
+	memset(mp, 0, sizeof *mp);
+	mp->allocator = cc->allocator;
+	mp->blocksize = cc->blocksize;
+	mp->reqwidth = cc->reqwidth;
+	mp->maxtail = cc->maxtail;
+	mp->ncore = cc->ncore;
+	mp->nocc = cc->nocc;
+	mp->method = CCSD_METHOD_MP2;
+	build(mp, cc->nocc - cc->ncore, v, fno_equations);
+	ccsd_load_integrals(mp, load, arg);
+	mp2_amplitudes(mp);
+	run_steps(mp, mp->nsetup, mp->nsteps);
+
+	/* both matrices are the same for both spins */
+	dm = xmalloc(4 * v * v * sizeof *dm);
+	fm = xmalloc(4 * v * v * sizeof *fm);
+	a = xmalloc(v * v * sizeof *a);
+	f = xmalloc(v * v * sizeof *f);
+	w = xmalloc(v * sizeof *w);
+	gather_matrix(mp->t[find_tensor(mp, "dm_vv")], dm, 2 * v);
+	gather_matrix(mp->t[find_tensor(mp, "f_vv")], fm, 2 * v);
+	for (j = 0; j < v; j++) {
+		for (i = 0; i < v; i++) {
+			a[j*v+i] = dm[j*2*v+i];
+			f[j*v+i] = fm[j*2*v+i];
+		}
+	}
+	release(mp);
+	free(mp->eocc);
+	free(mp->evir);
+	free(mp);
+	free(dm);
+	free(fm);
+
+	eigen(v, a, w);
+	/* eigenvalues are in ascending order */
+	for (nv = 0; nv < v && w[v-1-nv] > cc->fno; nv++)
+		;
+	if (nv == 0)
+		nv = 1;
+	free(cc->fnovec);
+	cc->fnovec = xmalloc(v * nv * sizeof *cc->fnovec);
+	for (j = 0; j < nv; j++)
+		memcpy(cc->fnovec + j*v, a + (v-1-j)*v, v * sizeof *a);
+	free(cc->evir);
+	cc->evir = xmalloc(nv * sizeof *cc->evir);
+	semicanonicalize(cc->fnovec, f, v, nv, cc->evir);
+	free(a);
+	free(f);
+	free(w);
+	print("frozen natural orbitals: %zu of %zu virtuals kept\n", nv, v);
+	return nv;
+}
+
+/*
+ * Return the transformation from the full to the truncated virtuals of
+ * both spins as a dense 2 vfull by 2 v matrix.
+ */
+static double *
+fno_matrix(struct ccsd *cc)
+{
+	double *mat;
+	size_t i, j, vf = cc->vfull, v = cc->v;
+
+	mat = xmalloc(4 * vf * v * sizeof *mat);
+	memset(mat, 0, 4 * vf * v * sizeof *mat);
+	for (j = 0; j < v; j++) {
+		for (i = 0; i < vf; i++) {
+			mat[j*2*vf+i] = cc->fnovec[j*vf+i];
+			mat[(j+v)*2*vf+vf+i] = cc->fnovec[j*vf+i];
+		}
+	}
+	return mat;
+}
+
+/*
+ * Return the selection of the active from all occupied orbitals of both
+ * spins as a dense 2 nocc by 2 o matrix.
+ */
+static double *
+core_matrix(struct ccsd *cc)
+{
+	double *mat;
+	size_t j, no = cc->nocc, o = cc->o;
+
+	mat = xmalloc(4 * no * o * sizeof *mat);
+	memset(mat, 0, 4 * no * o * sizeof *mat);
+	for (j = 0; j < o; j++) {
+		mat[j*2*no+cc->ncore+j] = 1;
+		mat[(j+o)*2*no+no+cc->ncore+j] = 1;
+	}
+	return mat;
+}
+
+static void
+free_tensor(xm_tensor_t *t, xm_block_space_t *bs)
+{
+	xm_tensor_free_block_data(t);
+	xm_tensor_free(t);
+	xm_block_space_free(bs);
+}
+
+/*
+ * Transform each dimension l of src for which u[l] is not NULL with the
+ * dense matrix u[l], whose rows span that dimension of src and columns
+ * that of dst, and set the canonical blocks of dst.  The canonical blocks
+ * of dst that share their block indices in the other dimensions are
+ * formed together from one dense slab of src, so every block of src is
+ * read once and only the symmetric dst is stored.  The slabs are aligned
+ * and their leading dimension is padded to width elements.
+ */
+static void
+transform_dims(const xm_tensor_t *src, xm_tensor_t *dst,
+    const double *const *u, size_t width)
+{
+	xm_dim_t nbs, nbd, ads, add, *blks;
+	struct keyed *keys;
+	size_t *offs[XM_MAX_DIM], *offd[XM_MAX_DIM], *grp;
+	size_t g, i, k, m, n, ng, nblks, maxslab = 1, maxblk;
+	int rank = 0, nproc = 1;
+
+#ifdef XM_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+#endif
+	nbs = xm_tensor_get_nblocks(src);
+	nbd = xm_tensor_get_nblocks(dst);
+	ads = xm_tensor_get_abs_dims(src);
+	add = xm_tensor_get_abs_dims(dst);
+	n = nbd.n;
+	for (k = 0; k < n; k++) {
+		offs[k] = xmalloc((nbs.i[k] + 1) * sizeof **offs);
+		offd[k] = xmalloc((nbd.i[k] + 1) * sizeof **offd);
+		block_offsets(src, k, offs[k]);
+		block_offsets(dst, k, offd[k]);
+		for (i = 0, m = 0; i < nbd.i[k]; i++)
+			if (offd[k][i+1] - offd[k][i] > m)
+				m = offd[k][i+1] - offd[k][i];
+		m = u[k] ? ads.i[k] : m;
+		maxslab *= k == 0 ? pad_width(m, width) : m;
+	}
+	maxblk = xm_tensor_get_largest_block_size(src);
+	if (xm_tensor_get_largest_block_size(dst) > maxblk)
+		maxblk = xm_tensor_get_largest_block_size(dst);
+
+	/* group the blocks of dst by their untransformed indices */
+	xm_tensor_get_canonical_block_list(dst, &blks, &nblks);
+	keys = xmalloc(nblks * sizeof *keys);
+	for (i = 0; i < nblks; i++) {
+		keys[i].i = i;
+		keys[i].key = 0;
+		for (k = n; k-- > 0; )
+			keys[i].key = keys[i].key * nbd.i[k] +
+			    (u[k] ? 0 : blks[i].i[k]);
+	}
+	qsort(keys, nblks, sizeof *keys, compare_keyed);
+	grp = xmalloc((nblks + 1) * sizeof *grp);
+	for (i = 0, ng = 0; i < nblks; i++)
+		if (i == 0 || keys[i].key != keys[i-1].key)
+			grp[ng++] = i;
+	grp[ng] = nblks;
+#pragma omp parallel private(g)
+{
+	double *x = xmalloc_aligned(maxslab * sizeof *x);
+	double *y = xmalloc_aligned(maxslab * sizeof *y);
+	double *blk = xmalloc(maxblk * sizeof *blk);
+#pragma omp for schedule(dynamic)
+	for (g = 0; g < ng; g++) {
+		xm_dim_t outer, idx, bd;
+		size_t j, l, r, len, left, right;
+		size_t sd[XM_MAX_DIM], off[XM_MAX_DIM], d[XM_MAX_DIM];
+		double one = 1, zero = 0, *tmp;
+		int mm, nn, kk, ldx, ldy;
+
+		if ((int)(g % (size_t)nproc) != rank)
+			continue;
+		outer = blks[keys[grp[g]].i];
+		for (l = 0, len = 1; l < n; l++) {
+			sd[l] = u[l] ? ads.i[l] :
+			    offd[l][outer.i[l]+1] - offd[l][outer.i[l]];
+			if (l == 0)
+				sd[l] = pad_width(sd[l], width);
+			len *= sd[l];
+		}
+		memset(x, 0, len * sizeof *x);
+		idx = outer;
+		for (l = 0; l < n; l++)
+			if (u[l])
+				idx.i[l] = 0;
+		for (;;) {
+			if (xm_tensor_get_block_type(src, idx) !=
+			    XM_BLOCK_TYPE_ZERO) {
+				bd = xm_tensor_get_block_dims(src, idx);
+#pragma omp critical
+				xm_tensor_read_block(src, idx, blk);
+				for (l = 0; l < n; l++) {
+					off[l] = 0;
+					if (u[l])
+						off[l] = offs[l][idx.i[l]];
+					d[l] = bd.i[l];
+				}
+				copy_box(x, sd, off, blk, d, n, 1);
+			}
+			for (l = 0; l < n; l++) {
+				if (!u[l])
+					continue;
+				if (++idx.i[l] < nbs.i[l])
+					break;
+				idx.i[l] = 0;
+			}
+			if (l == n)
+				break;
+		}
+		/*
+		 * Apply u to each selected dimension in turn.  The padding
+		 * of the leading dimension is carried along as extra rows.
+		 */
+		for (l = 0; l < n; l++) {
+			if (!u[l])
+				continue;
+			for (j = 0, left = 1; j < l; j++)
+				left *= sd[j];
+			for (j = l + 1, right = 1; j < n; j++)
+				right *= sd[j];
+			nn = (int)add.i[l];
+			kk = (int)ads.i[l];
+			if (l == 0) {
+				mm = (int)right;
+				ldx = (int)sd[0];
+				ldy = (int)pad_width(add.i[0], width);
+				dgemm_("T", "N", &nn, &mm, &kk, &one, u[0],
+				    &kk, x, &ldx, &zero, y, &ldy);
+				sd[0] = (size_t)ldy;
+			} else {
+				mm = (int)left;
+				for (r = 0; r < right; r++)
+					dgemm_("N", "N", &mm, &nn, &kk, &one,
+					    x + r * left * ads.i[l], &mm,
+					    u[l], &kk, &zero,
+					    y + r * left * add.i[l], &mm);
+				sd[l] = add.i[l];
+			}
+			tmp = x;
+			x = y;
+			y = tmp;
+		}
+		for (j = grp[g]; j < grp[g+1]; j++) {
+			idx = blks[keys[j].i];
+			bd = xm_tensor_get_block_dims(dst, idx);
+			for (l = 0; l < n; l++) {
+				off[l] = u[l] ? offd[l][idx.i[l]] : 0;
+				d[l] = bd.i[l];
+			}
+			copy_box(x, sd, off, blk, d, n, 0);
+#pragma omp critical
+			xm_tensor_write_block(dst, idx, blk);
+		}
+	}
+	free(x);
+	free(y);
+	free(blk);
+}
+	for (k = 0; k < n; k++) {
+		free(offs[k]);
+		free(offd[k]);
+	}
+	free(blks);
+	free(keys);
+	free(grp);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+/*
+ * Load the Fock matrix block name over space and return n elements of
+ * its diagonal starting at skip.  Both spins share the values.
+ */
+static double *
+fock_diagonal(struct ccsd *cc, const char *name, const char *space,
+    size_t skip, size_t n, ccsd_load_fn load, void *arg)
+{
+	xm_block_space_t *bs;
+	xm_tensor_t *t;
+	double *mat, *e;
+	size_t i, dim;
+
+	bs = create_block_space(cc, space);
+	t = xm_tensor_create(bs, XM_SCALAR_DOUBLE, cc->allocator);
+	init_oo(xm_block_space_get_nblocks(bs).i[0] / 2, 0, t);
+	load(t, name, arg);
+	dim = xm_block_space_get_abs_dims(bs).i[0];
+	mat = xmalloc(dim * dim * sizeof *mat);
+	gather_matrix(t, mat, dim);
+	free_tensor(t, bs);
+	e = xmalloc(n * sizeof *e);
+	for (i = 0; i < n; i++)
+		e[i] = mat[(skip+i)*(dim+1)];
+	free(mat);
+	return e;
+}
+
+/*
+ * Set the canonical blocks of a denominator to the sum of the occupied
+ * minus the sum of the virtual orbital energies of its indices, e.g.
+ * d_oovv(ijab) = e_i + e_j - e_a - e_b.
+ */
+static void
+set_denominator(struct ccsd *cc, xm_tensor_t *t, const char *space)
+{
+	xm_dim_t nb, *blks;
+	size_t *off[MAX_RANK], i, k, n = strlen(space), nblks, maxsize;
+	int rank = 0, nproc = 1;
+
+#ifdef XM_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+#endif
+	nb = xm_tensor_get_nblocks(t);
+	for (k = 0; k < n; k++) {
+		off[k] = xmalloc((nb.i[k] + 1) * sizeof **off);
+		block_offsets(t, k, off[k]);
+	}
+	xm_tensor_get_canonical_block_list(t, &blks, &nblks);
+	maxsize = xm_tensor_get_largest_block_size(t);
+#pragma omp parallel private(i)
+{
+	double *buf = xmalloc(maxsize * sizeof *buf);
+#pragma omp for schedule(dynamic)
+	for (i = 0; i < nblks; i++) {
+		xm_dim_t bd, y;
+		size_t j, l, p, len;
+		double x;
+
+		if ((int)(i % (size_t)nproc) != rank)
+			continue;
+		bd = xm_tensor_get_block_dims(t, blks[i]);
+		y = xm_dim_zero(n);
+		len = xm_dim_dot(&bd);
+		for (j = 0; j < len; j++) {
+			for (l = 0, x = 0; l < n; l++) {
+				p = off[l][blks[i].i[l]] + y.i[l];
+				x += space[l] == 'o' ? cc->eocc[p % cc->o] :
+				    -cc->evir[p % cc->v];
+			}
+			buf[j] = x;
+			xm_dim_inc(&y, &bd);
+		}
+#pragma omp critical
+		xm_tensor_write_block(t, blks[i], buf);
+	}
+	free(buf);
+}
+	free(blks);
+	for (k = 0; k < n; k++)
+		free(off[k]);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+/*
+ * Load input tensor k over all occupied orbitals if s is set and over the
+ * full virtuals if u is set, then drop the core orbitals with s and
+ * transform the virtual indices into the truncated space with u.  Up to
+ * two virtual indices are transformed together.  With more, the last two
+ * go first into an intermediate that keeps the symmetry of that pair and
+ * is smaller than the loaded tensor.
+ */
+static void
+load_transformed(struct ccsd *cc, int k, const double *s, const double *u,
+    ccsd_load_fn load, void *arg)
+{
+	const struct tensor *tn = &cc->tensors[k];
+	xm_block_space_t *bs, *mbs;
+	xm_tensor_t *cur, *mid;
+	const double *m[MAX_RANK];
+	char space[MAX_RANK+1];
+	size_t i, no = 0, nv = 0, n = strlen(tn->space), ob, vb, cb, fb;
+
+	ob = count_blocks(cc, cc->o);
+	vb = count_blocks(cc, cc->v);
+	cb = s ? count_blocks(cc, cc->nocc) : ob;
+	fb = u ? count_blocks(cc, cc->vfull) : vb;
+	for (i = 0; i < n; i++) {
+		if (tn->space[i] == 'o' && s) {
+			space[i] = 'O';
+			no++;
+		} else if (tn->space[i] == 'v' && u) {
+			space[i] = 'V';
+			nv++;
+		} else
+			space[i] = tn->space[i];
+	}
+	space[n] = '\0';
+	bs = create_block_space(cc, space);
+	cur = xm_tensor_create(bs, XM_SCALAR_DOUBLE, cc->allocator);
+	if (tn->nosym)
+		init_nosym(cur);
+	else
+		init_tensor(cur, tn->space, cb, fb);
+	load(cur, tn->name, arg);
+	if (no > 0 && nv > 0) {
+		for (i = 0; i < n; i++) {
+			m[i] = space[i] == 'O' ? s : NULL;
+			if (space[i] == 'O')
+				space[i] = 'o';
+		}
+		mbs = create_block_space(cc, space);
+		mid = xm_tensor_create(mbs, XM_SCALAR_DOUBLE, cc->allocator);
+		if (tn->nosym)
+			init_nosym(mid);
+		else
+			init_tensor(mid, tn->space, ob, fb);
+		transform_dims(cur, mid, m, cc->vecwidth);
+		free_tensor(cur, bs);
+		cur = mid;
+		bs = mbs;
+	}
+	if (nv > 2) {
+		for (i = n, nv = 0; i-- > 0; ) {
+			m[i] = NULL;
+			if (space[i] == 'V' && nv < 2) {
+				m[i] = u;
+				space[i] = 'v';
+				nv++;
+			}
+		}
+		mbs = create_block_space(cc, space);
+		mid = xm_tensor_create(mbs, XM_SCALAR_DOUBLE, cc->allocator);
+		/* ovvv and vvvv are the only such spaces with symmetry */
+		if (tn->nosym)
+			init_nosym(mid);
+		else if (strcmp(tn->space, "vvvv") == 0)
+			init_oovv(fb, vb, mid);
+		else
+			init_ovvv(ob, fb, vb, mid);
+		transform_dims(cur, mid, m, cc->vecwidth);
+		free_tensor(cur, bs);
+		cur = mid;
+		bs = mbs;
+	}
+	for (i = 0; i < n; i++)
+		m[i] = space[i] == 'O' ? s : space[i] == 'V' ? u : NULL;
+	transform_dims(cur, cc->t[k], m, cc->vecwidth);
+	free_tensor(cur, bs);
+}
+
+void
+ccsd_load_integrals(ccsd_t *cc, ccsd_load_fn load, void *arg)
+{
+	double *s = NULL, *u = NULL;
+	const char *space;
+	size_t i, nv;
+	int fno = cc->fno > 0 && cc->method == CCSD_METHOD_CCSD;
+	time_t timer;
+
+	if (fno) {
+		nv = fno_vectors(cc, load, arg);
+		if (!cc->ready || cc->v != nv) {
+			release(cc);
+			build(cc, cc->nocc - cc->ncore, nv,
+			    equations_text(cc));
+		}
+		u = fno_matrix(cc);
+	}
+	if (cc->ncore > 0) {
+		s = core_matrix(cc);
+		if (!fno) {
+			free(cc->evir);
+			cc->evir = fock_diagonal(cc, "f_vv", "vv", 0, cc->v,
+			    load, arg);
+		}
+	}
+	if (s || u) {
+		free(cc->eocc);
+		cc->eocc = fock_diagonal(cc, "f_oo", "OO", cc->ncore, cc->o,
+		    load, arg);
+	}
+	timer = timer_start("filling the tensors");
+	for (i = 0; i < cc->ntensors; i++) {
+		if (cc->tensors[i].role != ROLE_INPUT)
+			continue;
+		space = cc->tensors[i].space;
+		if ((s || u) && cc->tensors[i].denominator)
+			set_denominator(cc, cc->t[i], space);
+		else if ((s && strchr(space, 'o') != NULL) ||
+		    (u && strchr(space, 'v') != NULL))
+			load_transformed(cc, (int)i, s, u, load, arg);
+		else
+			load(cc->t[i], cc->tensors[i].name, arg);
+	}
+	run_steps(cc, 0, cc->nsetup);
+	timer_stop(timer);
+	free(s);
+	free(u);
+}
+
+double
+ccsd_solve(ccsd_t *cc, size_t maxiter, double conv)
+{
+	char title[64];
+	const char *name;
+	double prev = 0;
+	size_t i, iter;
+	int mp2;
+	time_t timer;
+
+	if (cc->method == CCSD_METHOD_MP2) {
+		mp2_amplitudes(cc);
+		cc->energy = cc->emp2;
+		return cc->energy;
+	}
+	if (!cc->warm) {
+		mp2 = mp2_amplitudes(cc) == 0;
+		for (i = 0; i < cc->ntensors; i++) {
+			name = cc->tensors[i].name;
+			if (cc->tensors[i].role != ROLE_AMPLITUDE)
+				continue;
+			if (mp2 && (strcmp(name, "t1") == 0 ||
+			    strcmp(name, "t2") == 0))
+				continue;
+			xm_set(cc->t[i], 0);
+		}
+	}
+	cc->warm = 1;
+	for (iter = 1; iter <= maxiter; iter++) {
+		snprintf(title, sizeof title, "running ccsd iteration %zu",
+		    iter);
+		timer = timer_start(title);
+		print("\n");
+		run_steps(cc, cc->nsetup, cc->nsteps);
+		print("energy = %.10lf\n", cc->energy);
+		timer_stop(timer);
+		/* compare only energies of this solve */
+		if (iter > 1 && fabs(cc->energy - prev) < conv)
+			break;
+		prev = cc->energy;
+	}
+	return cc->energy;
+}
+
+double
+ccsd_get_energy(ccsd_t *cc)
+{
+	return cc->energy;
+}
+
+double
+ccsd_get_mp2_energy(ccsd_t *cc)
+{
+	return cc->emp2;
+}
+
+size_t
+ccsd_get_nvirt(ccsd_t *cc)
+{
+	return cc->v;
+}
+
+xm_tensor_t *
+ccsd_get_tensor(ccsd_t *cc, const char *name)
+{
+	int t;
+
+	if (!cc->ready || (t = find_tensor(cc, name)) == -1)
+		return NULL;
+	return cc->t[t];
+}
+
+void
+ccsd_destroy(ccsd_t *cc)
+{
+	time_t timer;
+
+	if (cc == NULL)
+		return;
+	timer = timer_start("releasing the resources");
+	release(cc);
+	free(cc->equations);
+	free(cc->fnovec);
+	free(cc->eocc);
+	free(cc->evir);
+	xm_allocator_destroy(cc->allocator);
+	free(cc);
+	timer_stop(timer);
 }
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2017 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CCSD_H_INCLUDED
+#define CCSD_H_INCLUDED
+
+#include "xm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque CCSD solver context. */
+typedef struct ccsd ccsd_t;
+
+/* Correlation methods. */
+enum {
+	CCSD_METHOD_CCSD,	/* iterate the CCSD equations */
+	CCSD_METHOD_MP2		/* stop after the MP2 energy */
+};
+
+/* Called once per input tensor to fill it with integrals. */
+typedef void (*ccsd_load_fn)(xm_tensor_t *t, const char *name, void *arg);
+
+/* Create a context with its tensor data stored in the given file.
+ * When compiled with MPI support, MPI must be initialized first. */
+ccsd_t *ccsd_create(const char *pagefile);
+
+/* Set the block size, the vector width and the largest allowed fraction
+ * of elements outside whole vectors, above which the width is halved.
+ * The dense work buffers of the contractions done outside libxm are
+ * 64-byte aligned with their columns padded to the width.  The defaults
+ * are 32, 1 and 0.1. */
+void ccsd_set_blocking(ccsd_t *cc, size_t blocksize, size_t vecwidth,
+    double maxtail);
+
+/* Use the given tensor equations for the iteration.  NULL selects the
+ * built-in CCSD equations.  Returns -1 and keeps the previous equations if
+ * the text has an error, which is printed to stderr. */
+int ccsd_set_equations(ccsd_t *cc, const char *text);
+
+/* Enable the contraction layout planner and the grouping of the steps
+ * that read each integral tensor.  The planner picks the storage order
+ * of the intermediates made by factorizing products and copies tensors
+ * into temporaries without symmetry where the estimated transposes saved
+ * exceed the copy; inputs are copied once after loading.  Grouping runs
+ * the steps that read an integral tensor back to back and fuses those
+ * that contract it with a 2-index tensor into one pass over its blocks;
+ * the other steps still read the whole tensor each. */
+void ccsd_set_planning(ccsd_t *cc, int layout, int grouping);
+
+/* Select the method.  MP2 creates only the ov and oovv tensors it
+ * needs, so it runs at sizes where CCSD does not fit.  The default is
+ * CCSD. */
+void ccsd_set_method(ccsd_t *cc, int method);
+
+/* Exclude the lowest ncore occupied orbitals of each spin from the
+ * correlation treatment.  Must be less than the o given to ccsd_setup.
+ * The load function gets tensors over all o occupied orbitals and the
+ * core ones are dropped after loading.  The denominators are not loaded
+ * but built from the diagonals of f_oo and f_vv. */
+void ccsd_set_frozen_core(ccsd_t *cc, size_t ncore);
+
+/* Truncate the virtuals to the MP2 frozen natural orbitals with
+ * occupation above thresh, rotated to diagonalize the virtual Fock block.
+ * The load function then gets tensors in the full virtual space, which are
+ * transformed into the truncated one.  The denominators are not loaded but
+ * built from the diagonal of f_oo and the energies of the kept orbitals.
+ * Zero, the default, disables the truncation. */
+void ccsd_set_fno(ccsd_t *cc, double thresh);
+
+/* Create the block spaces and tensors for o occupied and v virtual
+ * orbitals of each spin.  Does nothing if the dimensions and settings did
+ * not change since the last call, so the amplitudes are kept.  With FNO
+ * the tensors are created by ccsd_load_integrals. */
+void ccsd_setup(ccsd_t *cc, size_t o, size_t v);
+
+/* Fill every tensor that is never written by the iteration. */
+void ccsd_load_integrals(ccsd_t *cc, ccsd_load_fn load, void *arg);
+
+/* Iterate until the energy changes by less than conv between two
+ * iterations of this solve or maxiter iterations are done.  The first
+ * solve after setup starts from the MP2 amplitudes, later ones from the
+ * amplitudes of the previous solve.  With the MP2 method only the MP2
+ * energy is computed.  Returns the energy. */
+double ccsd_solve(ccsd_t *cc, size_t maxiter, double conv);
+
+/* Return the energy of the last iteration. */
+double ccsd_get_energy(ccsd_t *cc);
+
+/* Return the MP2 energy of the starting amplitudes.  It is computed by the
+ * first solve after setup and kept by the later solves that continue from
+ * the previous amplitudes; with the MP2 method every solve computes it. */
+double ccsd_get_mp2_energy(ccsd_t *cc);
+
+/* Return the number of virtuals per spin after the FNO truncation. */
+size_t ccsd_get_nvirt(ccsd_t *cc);
+
+/* Return the tensor with the given name or NULL.  The amplitudes are
+ * named t1 and t2 in the built-in equations. */
+xm_tensor_t *ccsd_get_tensor(ccsd_t *cc, const char *name);
+
+/* Release all resources of the context. */
+void ccsd_destroy(ccsd_t *cc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CCSD_H_INCLUDED */
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2017 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#ifdef XM_USE_MPI
+#include <mpi.h>
+#endif
+
+#include "ccsd.h"
+
+static void
+usage(void)
+{
+	int rank = 0;
+
+#ifdef XM_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+	if (rank == 0)
+		printf("usage: ccsd [-b bs] [-c ncore] [-e file] [-f occ] [-l] "
+		    "[-n niter] [-o no]\n"
+		    "            [-v nv] [-w width] [-p maxtail] [-s] "
+		    "[--mp2]\n");
+#ifdef XM_USE_MPI
+	MPI_Finalize();
+#endif
+	exit(1);
+}
+
+static char *
+read_file(const char *path)
+{
+	FILE *fp;
+	char *text;
+	long size;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	if ((text = malloc((size_t)size + 1)) == NULL) {
+		perror("malloc");
+		abort();
+	}
+	text[fread(text, 1, (size_t)size, fp)] = '\0';
+	fclose(fp);
+	return text;
+}
+
+/*
+ * Fill the integrals with random data.  The occupied and virtual Fock
+ * blocks get opposite signs, so the denominators built from their
+ * diagonals under -c and -f stay away from zero.
+ */
+static void
+load_random(xm_tensor_t *t, const char *name, void *arg)
+{
+	(void)arg;
+
+	if (strcmp(name, "f_oo") == 0)
+		xm_set(t, -1);
+	else if (strcmp(name, "f_vv") == 0)
+		xm_set(t, 1);
+	else
+		xm_set(t, drand48() / 1000000.0);
+}
+
+static const struct option longopts[] = {
+	{ "mp2", no_argument, NULL, 'm' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int
+main(int argc, char **argv)
+{
+	ccsd_t *cc;
+	double maxtail = 0.1, fno = 0;
+	size_t blocksize = 32, vecwidth = 1, niter = 1, ncore = 0;
+	size_t o = 10, v = 40;
+	int ch, method = CCSD_METHOD_CCSD, planner = 0, grouping = 0;
+	char *equations = NULL;
+
+#ifdef XM_USE_MPI
+	MPI_Init(&argc, &argv);
+#endif
+	while ((ch = getopt_long(argc, argv, "b:c:e:f:ln:o:p:sv:w:",
+	    longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'b':
+			blocksize = (size_t)strtoll(optarg, NULL, 10);
+			break;
+		case 'c':
+			ncore = (size_t)strtoll(optarg, NULL, 10);
+			break;
+		case 'e':
+			free(equations);
+			equations = read_file(optarg);
+			break;
+		case 'f':
+			fno = strtod(optarg, NULL);
+			break;
+		case 'l':
+			planner = 1;
+			break;
+		case 'm':
+			method = CCSD_METHOD_MP2;
+			break;
+		case 'n':
+			niter = (size_t)strtoll(optarg, NULL, 10);
+			break;
+		case 'o':
+			o = (size_t)strtoll(optarg, NULL, 10);
+			break;
+		case 'p':
+			maxtail = strtod(optarg, NULL) / 100.0;
+			break;
+		case 's':
+			grouping = 1;
+			break;
+		case 'v':
+			v = (size_t)strtoll(optarg, NULL, 10);
+			break;
+		case 'w':
+			vecwidth = (size_t)strtoll(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (blocksize == 0 || o == 0 || v == 0 || vecwidth == 0 ||
+	    maxtail < 0 || niter == 0 || ncore >= o || fno < 0)
+		usage();
+	if ((cc = ccsd_create("xmpagefile")) == NULL) {
+		fprintf(stderr, "cannot create the ccsd context\n");
+		abort();
+	}
+	ccsd_set_blocking(cc, blocksize, vecwidth, maxtail);
+	if (ccsd_set_equations(cc, equations) != 0) {
+		free(equations);
+		ccsd_destroy(cc);
+#ifdef XM_USE_MPI
+		MPI_Finalize();
+#endif
+		return 1;
+	}
+	ccsd_set_planning(cc, planner, grouping);
+	ccsd_set_method(cc, method);
+	ccsd_set_frozen_core(cc, ncore);
+	ccsd_set_fno(cc, fno);
+	free(equations);
+	ccsd_setup(cc, o, v);
+	ccsd_load_integrals(cc, load_random, NULL);
+	ccsd_solve(cc, niter, 0);
+	ccsd_destroy(cc);
+#ifdef XM_USE_MPI
+	MPI_Finalize();
+#endif
+	return 0;
+}